@@ -19,49 +19,390 @@
  * Author:  Behdad Esfahbod, Red Hat, Inc.
  */
 
-/* NOTE: This file is copied from gnome-settings-daemon, please keep it in sync */
+/* NOTE: This file is based on gnome-settings-daemon's fc-monitor.c. Unlike
+ * the original it doesn't keep a font set loaded unless asked to and
+ * tracks the font families that changed. */
 
 #include "fc-monitor.h"
 
+#include <string.h>
+
 #include <gio/gio.h>
+#include <glib/gstdio.h>
 #include <fontconfig/fontconfig.h>
 
 #define TIMEOUT_MILLISECONDS 1000
+/* Nothing is watched without an initial scan so retry it after a while */
+#define RETRY_SECONDS 30
+
+/* What we know about a font directory as of its modification time.
+ * Records are immutable and shared between scans. */
+typedef struct {
+        gint64 mtime;
+        GHashTable *families;
+        GStrv subdirs;
+} DirRecord;
+
+/* The result of walking the font directories */
+typedef struct {
+        /* The parsed configuration without any fonts loaded */
+        FcConfig *config;
+        char *config_fingerprint;
+        /* path -> DirRecord */
+        GHashTable *dirs;
+        /* family -> hash over its faces */
+        GHashTable *families;
+        char *fingerprint;
+} ScanState;
+
+typedef struct {
+        ScanState *scan;
+        GStrv added;
+        GStrv removed;
+        /* Time spent walking the directories and reinitializing in µs */
+        gint64 scan_time;
+        gint64 reinit_time;
+} UpdateResult;
+
+typedef struct {
+        ScanState *previous;
+} UpdateData;
+
+static gboolean reload_fonts (FcMonitor *self);
+
+static void
+dir_record_clear (DirRecord *record)
+{
+        g_clear_pointer (&record->families, g_hash_table_unref);
+        g_clear_pointer (&record->subdirs, g_strfreev);
+}
+
+static void
+dir_record_unref (DirRecord *record)
+{
+        g_atomic_rc_box_release_full (record, (GDestroyNotify) dir_record_clear);
+}
+
+static void
+scan_state_clear (ScanState *scan)
+{
+        g_clear_pointer (&scan->config, FcConfigDestroy);
+        g_clear_pointer (&scan->config_fingerprint, g_free);
+        g_clear_pointer (&scan->dirs, g_hash_table_unref);
+        g_clear_pointer (&scan->families, g_hash_table_unref);
+        g_clear_pointer (&scan->fingerprint, g_free);
+}
+
+static void
+scan_state_unref (ScanState *scan)
+{
+        g_atomic_rc_box_release_full (scan, (GDestroyNotify) scan_state_clear);
+}
+
+static void
+update_result_free (UpdateResult *result)
+{
+        g_clear_pointer (&result->scan, scan_state_unref);
+        g_strfreev (result->added);
+        g_strfreev (result->removed);
+        g_free (result);
+}
+
+static void
+update_data_free (UpdateData *data)
+{
+        g_clear_pointer (&data->previous, scan_state_unref);
+        g_free (data);
+}
+
+/* Adds the file's modification time to @checksum, returns it in µs or -1 */
+static gint64
+checksum_add_path (GChecksum *checksum,
+                   const char *path)
+{
+        GStatBuf st;
+        gint64 mtime = -1;
+
+        if (g_stat (path, &st) == 0)
+                mtime = (gint64) st.st_mtim.tv_sec * G_USEC_PER_SEC + st.st_mtim.tv_nsec / 1000;
+
+        g_checksum_update (checksum, (const guchar *) path, strlen (path) + 1);
+        g_checksum_update (checksum, (const guchar *) &mtime, sizeof (mtime));
+
+        return mtime;
+}
+
+static char *
+get_config_fingerprint (FcConfig *config)
+{
+        GChecksum *checksum = g_checksum_new (G_CHECKSUM_SHA256);
+        FcStrList *list = FcConfigGetConfigFiles (config);
+        const FcChar8 *file;
+        char *fingerprint;
+
+        while ((file = FcStrListNext (list)))
+                checksum_add_path (checksum, (const char *) file);
+        FcStrListDone (list);
+
+        fingerprint = g_strdup (g_checksum_get_string (checksum));
+        g_checksum_free (checksum);
+
+        return fingerprint;
+}
+
+/* Faces are combined order independently so the result doesn't depend
+ * on the order we see them in */
+static void
+merge_family (GHashTable *families,
+              const char *family,
+              guint faces)
+{
+        gpointer key, value;
+
+        if (g_hash_table_lookup_extended (families, family, &key, &value)) {
+                faces += GPOINTER_TO_UINT (value);
+                g_hash_table_steal (families, key);
+        } else {
+                key = g_strdup (family);
+        }
+
+        g_hash_table_insert (families, key, GUINT_TO_POINTER (faces));
+}
+
+/* Adds the families in @font_set to @families mapping each family
+ * name to a hash over the faces (file and index) that provide it so
+ * we can tell when a family's set of faces changed */
+static void
+add_families (GHashTable *families,
+              FcFontSet *font_set)
+{
+        int i;
+
+        for (i = 0; font_set && i < font_set->nfont; i++) {
+                FcChar8 *family = NULL;
+                FcChar8 *file = NULL;
+                int index = 0;
+
+                if (FcPatternGetString (font_set->fonts[i], FC_FAMILY, 0, &family) != FcResultMatch)
+                        continue;
+                if (FcPatternGetString (font_set->fonts[i], FC_FILE, 0, &file) != FcResultMatch)
+                        file = (FcChar8 *) "";
+                FcPatternGetInteger (font_set->fonts[i], FC_INDEX, 0, &index);
+
+                merge_family (families, (const char *) family,
+                              g_str_hash (file) ^ ((guint) index * 2654435761u));
+        }
+}
+
+static DirRecord *
+dir_record_scan (const char *path,
+                 gint64 mtime,
+                 FcConfig *config)
+{
+        DirRecord *record = g_atomic_rc_box_new0 (DirRecord);
+        GPtrArray *subdirs = g_ptr_array_new ();
+        FcCache *cache;
+
+        record->mtime = mtime;
+        record->families = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+        /* Only rescans the directory if its cache is stale */
+        cache = FcDirCacheRead ((const FcChar8 *) path, FcFalse, config);
+        if (cache) {
+                FcFontSet *font_set = FcCacheCopySet (cache);
+                int i;
+
+                add_families (record->families, font_set);
+                if (font_set)
+                        FcFontSetDestroy (font_set);
+
+                for (i = 0; i < FcCacheNumSubdir (cache); i++)
+                        g_ptr_array_add (subdirs, g_strdup ((const char *) FcCacheSubdir (cache, i)));
+
+                FcDirCacheUnload (cache);
+        } else {
+                g_debug ("Failed to read font cache for %s", path);
+        }
+
+        g_ptr_array_add (subdirs, NULL);
+        record->subdirs = (GStrv) g_ptr_array_free (subdirs, FALSE);
+
+        return record;
+}
+
+static int
+compare_strings (gconstpointer a,
+                 gconstpointer b)
+{
+        return g_strcmp0 (*(const char * const *) a, *(const char * const *) b);
+}
+
+/* Families in @a that are missing from @b or are provided by a different set of faces */
+static GStrv
+families_diff (GHashTable *a,
+               GHashTable *b)
+{
+        GPtrArray *diff = g_ptr_array_new ();
+        GHashTableIter iter;
+        gpointer key, value, other;
+
+        g_hash_table_iter_init (&iter, a);
+        while (g_hash_table_iter_next (&iter, &key, &value)) {
+                if (b && g_hash_table_lookup_extended (b, key, NULL, &other) && other == value)
+                        continue;
+
+                g_ptr_array_add (diff, g_strdup (key));
+        }
+
+        g_ptr_array_sort (diff, compare_strings);
+        g_ptr_array_add (diff, NULL);
+
+        return (GStrv) g_ptr_array_free (diff, FALSE);
+}
 
 static void
 fontconfig_cache_update_thread (GTask *task,
-                                gpointer source_object G_GNUC_UNUSED,
-                                gpointer task_data G_GNUC_UNUSED,
+                                gpointer source_object,
+                                gpointer task_data,
                                 GCancellable *cancellable G_GNUC_UNUSED)
 {
-        if (FcConfigUptoDate (NULL)) {
-                g_task_return_boolean (task, FALSE);
-                return;
+        UpdateData *data = task_data;
+        ScanState *previous = data->previous;
+        ScanState *scan = g_atomic_rc_box_new0 (ScanState);
+        GChecksum *checksum = g_checksum_new (G_CHECKSUM_SHA256);
+        GQueue queue = G_QUEUE_INIT;
+        UpdateResult *result;
+        GHashTableIter iter;
+        FcStrList *list;
+        const FcChar8 *dir;
+        DirRecord *record;
+        char *path;
+        gint64 start = g_get_monotonic_time ();
+        gint64 scan_time, reinit_time = 0;
+
+        /* Only reparse the configuration if one of its files changed */
+        if (previous) {
+                char *fingerprint = get_config_fingerprint (previous->config);
+
+                if (g_strcmp0 (fingerprint, previous->config_fingerprint) == 0) {
+                        scan->config = FcConfigReference (previous->config);
+                        scan->config_fingerprint = g_steal_pointer (&fingerprint);
+                }
+                g_free (fingerprint);
+        }
+
+        if (!scan->config) {
+                scan->config = FcInitLoadConfig ();
+                if (!scan->config) {
+                        g_checksum_free (checksum);
+                        scan_state_unref (scan);
+                        g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED,
+                                                 "FcInitLoadConfig failed");
+                        return;
+                }
+                scan->config_fingerprint = get_config_fingerprint (scan->config);
+        }
+        g_checksum_update (checksum, (const guchar *) scan->config_fingerprint, -1);
+
+        scan->dirs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                            (GDestroyNotify) dir_record_unref);
+        scan->families = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+        list = FcConfigGetFontDirs (scan->config);
+        while ((dir = FcStrListNext (list)))
+                g_queue_push_tail (&queue, g_strdup ((const char *) dir));
+        FcStrListDone (list);
+
+        /* Walk the font directories, only looking at the ones whose
+         * modification time changed since the last scan */
+        while ((path = g_queue_pop_head (&queue))) {
+                gint64 mtime;
+                int i;
+
+                if (g_hash_table_contains (scan->dirs, path)) {
+                        g_free (path);
+                        continue;
+                }
+
+                mtime = checksum_add_path (checksum, path);
+                if (mtime < 0) {
+                        g_free (path);
+                        continue;
+                }
+
+                record = previous ? g_hash_table_lookup (previous->dirs, path) : NULL;
+                if (record && record->mtime == mtime)
+                        record = g_atomic_rc_box_acquire (record);
+                else
+                        record = dir_record_scan (path, mtime, scan->config);
+
+                for (i = 0; record->subdirs[i]; i++)
+                        g_queue_push_tail (&queue, g_strdup (record->subdirs[i]));
+
+                g_hash_table_insert (scan->dirs, path, record);
         }
 
-        if (!FcInitReinitialize ()) {
-                g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED,
-                                         "FcInitReinitialize failed");
+        scan->fingerprint = g_strdup (g_checksum_get_string (checksum));
+        g_checksum_free (checksum);
+
+        if (previous && g_strcmp0 (scan->fingerprint, previous->fingerprint) == 0) {
+                g_debug ("Fontconfig scan of %u directories took %.1f ms, no changes",
+                         g_hash_table_size (scan->dirs),
+                         (g_get_monotonic_time () - start) / 1000.0);
+                scan_state_unref (scan);
+                g_task_return_pointer (task, NULL, NULL);
                 return;
         }
 
-        g_task_return_boolean (task, TRUE);
+        g_hash_table_iter_init (&iter, scan->dirs);
+        while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &record)) {
+                GHashTableIter family_iter;
+                gpointer family, faces;
+
+                g_hash_table_iter_init (&family_iter, record->families);
+                while (g_hash_table_iter_next (&family_iter, &family, &faces))
+                        merge_family (scan->families, family, GPOINTER_TO_UINT (faces));
+        }
+
+        scan_time = g_get_monotonic_time () - start;
+
+        /* Only refresh the in process font set if someone renders text */
+        if (reload_fonts (FC_MONITOR (source_object)))
+                reinit_time = g_get_monotonic_time () - start - scan_time;
+
+        result = g_new0 (UpdateResult, 1);
+        result->scan = scan;
+        result->scan_time = scan_time;
+        result->reinit_time = reinit_time;
+        if (previous) {
+                result->added = families_diff (scan->families, previous->families);
+                result->removed = families_diff (previous->families, scan->families);
+        }
+
+        g_task_return_pointer (task, result, (GDestroyNotify) update_result_free);
 }
 
 static void
-fontconfig_cache_update_async (GAsyncReadyCallback callback,
+fontconfig_cache_update_async (FcMonitor *self,
+                               ScanState *previous,
+                               GAsyncReadyCallback callback,
                                gpointer user_data)
 {
-        GTask *task = g_task_new (NULL, NULL, callback, user_data);
+        GTask *task = g_task_new (self, NULL, callback, user_data);
+        UpdateData *data = g_new0 (UpdateData, 1);
+
+        data->previous = previous ? g_atomic_rc_box_acquire (previous) : NULL;
+        g_task_set_task_data (task, data, (GDestroyNotify) update_data_free);
         g_task_run_in_thread (task, fontconfig_cache_update_thread);
         g_object_unref (task);
 }
 
-static gboolean
+/* Returns %NULL without setting @error if no update was necessary */
+static UpdateResult *
 fontconfig_cache_update_finish (GAsyncResult *result,
                                 GError **error)
 {
-        return g_task_propagate_boolean (G_TASK (result), error);
+        return g_task_propagate_pointer (G_TASK (result), error);
 }
 
 typedef enum {
@@ -79,6 +420,25 @@ struct _FcMonitor {
         guint timeout;
         UpdateState state;
         gboolean notify;
+
+        /* Guards load_fonts and fonts_released as well as replacing the
+         * current configuration, the update thread reloads fonts too */
+        GMutex fonts_lock;
+        gboolean load_fonts;
+        gboolean fonts_released;
+
+        /* When the first change of the current burst came in */
+        gint64 first_event_time;
+
+        /* Scan as of the last "updated" signal and the changes it reported */
+        ScanState *scan;
+        GStrv added;
+        GStrv removed;
+        /* Cost of the update that got reported last in µs */
+        gint64 scan_time;
+        gint64 reinit_time;
+        /* Result of the last successful update not yet reported */
+        UpdateResult *pending;
 };
 
 enum {
@@ -91,10 +451,12 @@ static guint signals[N_SIGNALS] = { 0, };
 
 static void fc_monitor_finalize (GObject *object);
 static void monitor_files (FcMonitor *self, FcStrList *list);
+static void monitor_dirs (FcMonitor *self, GHashTable *dirs);
 static void stuff_changed (GFileMonitor *monitor, GFile *file, GFile *other_file,
                            GFileMonitorEvent event_type, gpointer data);
 static void start_timeout (FcMonitor *self);
 static gboolean start_update (gpointer data);
+static void run_update (FcMonitor *self);
 static void update_done (GObject *source_object, GAsyncResult *result, gpointer user_data);
 
 G_DEFINE_TYPE (FcMonitor, fc_monitor, G_TYPE_OBJECT);
@@ -124,9 +486,9 @@ fc_monitor_new (void)
 }
 
 static void
-fc_monitor_init (FcMonitor *self G_GNUC_UNUSED)
+fc_monitor_init (FcMonitor *self)
 {
-        FcInit ();
+        g_mutex_init (&self->fonts_lock);
 }
 
 static void
@@ -139,6 +501,11 @@ fc_monitor_finalize (GObject *object)
         self->timeout = 0;
 
         g_clear_pointer (&self->monitors, g_ptr_array_unref);
+        g_clear_pointer (&self->scan, scan_state_unref);
+        g_clear_pointer (&self->added, g_strfreev);
+        g_clear_pointer (&self->removed, g_strfreev);
+        g_clear_pointer (&self->pending, update_result_free);
+        g_mutex_clear (&self->fonts_lock);
 
         G_OBJECT_CLASS (fc_monitor_parent_class)->finalize (object);
 }
@@ -151,8 +518,17 @@ fc_monitor_start (FcMonitor *self)
 
         self->monitors = g_ptr_array_new_with_free_func (g_object_unref);
 
-        monitor_files (self, FcConfigGetConfigFiles (NULL));
-        monitor_files (self, FcConfigGetFontDirs (NULL));
+        if (!self->scan) {
+                /* Watches get set up once the initial scan is done */
+                if (self->state == UPDATE_IDLE) {
+                        g_debug ("Starting initial fontconfig scan");
+                        run_update (self);
+                }
+                return;
+        }
+
+        monitor_files (self, FcConfigGetConfigFiles (self->scan->config));
+        monitor_dirs (self, self->scan->dirs);
 }
 
 void
@@ -162,6 +538,139 @@ fc_monitor_stop (FcMonitor *self)
         g_clear_pointer (&self->monitors, g_ptr_array_unref);
 }
 
+/**
+ * fc_monitor_set_load_fonts:
+ * @monitor: The fontconfig monitor
+ * @load_fonts: Whether the process needs an up to date font set
+ *
+ * By default the monitor only detects changes without loading any
+ * fonts into the process. Set @load_fonts to %TRUE while the process
+ * renders text so the current configuration gets refreshed on changes.
+ * Setting it back to %FALSE drops the reference to the loaded font set.
+ */
+void
+fc_monitor_set_load_fonts (FcMonitor *self,
+                           gboolean load_fonts)
+{
+        g_autoptr (GMutexLocker) locker = NULL;
+
+        g_return_if_fail (FC_IS_MONITOR (self));
+
+        locker = g_mutex_locker_new (&self->fonts_lock);
+        if (self->load_fonts == load_fonts)
+                return;
+
+        self->load_fonts = load_fonts;
+
+        if (load_fonts) {
+                /* Replace the empty configuration set when fonts got released */
+                if (self->fonts_released) {
+                        g_debug ("Loading fonts");
+                        if (!FcInitReinitialize ())
+                                g_warning ("FcInitReinitialize failed");
+                        self->fonts_released = FALSE;
+                }
+        } else {
+                FcConfig *empty = FcConfigCreate ();
+
+                /* Users still holding on to the old configuration keep it alive
+                 * until they're done, the font set gets freed afterwards. */
+                g_debug ("Releasing fonts");
+                if (FcConfigSetCurrent (empty))
+                        self->fonts_released = TRUE;
+                FcConfigDestroy (empty);
+        }
+}
+
+/* Called from the update thread so a release that happens while a scan
+ * is in flight doesn't get undone */
+static gboolean
+reload_fonts (FcMonitor *self)
+{
+        g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&self->fonts_lock);
+
+        if (!self->load_fonts)
+                return FALSE;
+
+        if (!FcInitReinitialize ())
+                g_warning ("FcInitReinitialize failed");
+
+        return TRUE;
+}
+
+/**
+ * fc_monitor_get_added_families:
+ * @monitor: The fontconfig monitor
+ *
+ * Families that appeared or whose set of faces changed with the last
+ * "updated" signal.
+ *
+ * Returns: (transfer none): The sorted family names
+ */
+const char * const *
+fc_monitor_get_added_families (FcMonitor *self)
+{
+        g_return_val_if_fail (FC_IS_MONITOR (self), NULL);
+
+        return (const char * const *) self->added;
+}
+
+/**
+ * fc_monitor_get_removed_families:
+ * @monitor: The fontconfig monitor
+ *
+ * Families that disappeared or whose set of faces changed with the
+ * last "updated" signal.
+ *
+ * Returns: (transfer none): The sorted family names
+ */
+const char * const *
+fc_monitor_get_removed_families (FcMonitor *self)
+{
+        g_return_val_if_fail (FC_IS_MONITOR (self), NULL);
+
+        return (const char * const *) self->removed;
+}
+
+/**
+ * fc_monitor_get_n_watches:
+ * @monitor: The fontconfig monitor
+ *
+ * The number of files and directories currently watched. This is 0
+ * until the initial scan is done.
+ *
+ * Returns: The number of watches
+ */
+guint
+fc_monitor_get_n_watches (FcMonitor *self)
+{
+        g_return_val_if_fail (FC_IS_MONITOR (self), 0);
+
+        return self->monitors ? self->monitors->len : 0;
+}
+
+/**
+ * fc_monitor_get_update_times:
+ * @monitor: The fontconfig monitor
+ * @scan_time: (out) (optional): Return location for the scan time
+ * @reinit_time: (out) (optional): Return location for the reinitialization time
+ *
+ * How long the update reported with the last "updated" signal spent
+ * walking the font directories and reloading the fonts in µs.
+ */
+void
+fc_monitor_get_update_times (FcMonitor *self,
+                             gint64 *scan_time,
+                             gint64 *reinit_time)
+{
+        g_return_if_fail (FC_IS_MONITOR (self));
+
+        if (scan_time)
+                *scan_time = self->scan_time;
+        if (reinit_time)
+                *reinit_time = self->reinit_time;
+}
+
 static void
 monitor_files (FcMonitor *self,
                FcStrList *list)
@@ -190,6 +699,34 @@ monitor_files (FcMonitor *self,
         FcStrListDone (list);
 }
 
+static void
+monitor_dirs (FcMonitor *self,
+              GHashTable *dirs)
+{
+        GHashTableIter iter;
+        const char *path;
+
+        g_hash_table_iter_init (&iter, dirs);
+        while (g_hash_table_iter_next (&iter, (gpointer *) &path, NULL)) {
+                GFile *file;
+                GFileMonitor *monitor;
+
+                file = g_file_new_for_path (path);
+
+                g_debug ("Monitoring %s", path);
+                monitor = g_file_monitor (file, G_FILE_MONITOR_NONE, NULL, NULL);
+
+                g_object_unref (file);
+
+                if (!monitor)
+                        continue;
+
+                g_signal_connect (monitor, "changed", G_CALLBACK (stuff_changed), self);
+
+                g_ptr_array_add (self->monitors, monitor);
+        }
+}
+
 static const gchar *
 get_name (GType enum_type,
           gint enum_value)
@@ -215,6 +752,7 @@ stuff_changed (GFileMonitor *monitor G_GNUC_UNUSED,
         switch (self->state) {
         case UPDATE_IDLE:
                 g_debug ("Got %-38s for %s: starting fontconfig update timeout", event_name, path);
+                self->first_event_time = g_get_monotonic_time ();
                 start_timeout (self);
                 break;
 
@@ -250,16 +788,23 @@ start_timeout (FcMonitor *self)
         g_source_set_name_by_id (self->timeout, "[gnome-settings-daemon] update");
 }
 
+static void
+run_update (FcMonitor *self)
+{
+        self->state = UPDATE_RUNNING;
+        fontconfig_cache_update_async (self, self->scan,
+                                       update_done, g_object_ref (self));
+}
+
 static gboolean
 start_update (gpointer data)
 {
         FcMonitor *self = FC_MONITOR (data);
 
-        self->state = UPDATE_RUNNING;
         self->timeout = 0;
 
         g_debug ("Timeout completed: starting fontconfig update");
-        fontconfig_cache_update_async (update_done, g_object_ref (self));
+        run_update (self);
 
         return G_SOURCE_REMOVE;
 }
@@ -271,26 +816,67 @@ update_done (GObject *source_object G_GNUC_UNUSED,
 {
         FcMonitor *self = FC_MONITOR (data);
         gboolean restart = self->state == UPDATE_RESTART;
+        gboolean retry = FALSE;
+        UpdateResult *update;
         GError *error = NULL;
 
         self->state = UPDATE_IDLE;
 
-        if (fontconfig_cache_update_finish (result, &error)) {
+        update = fontconfig_cache_update_finish (result, &error);
+        if (update && !self->scan) {
+                g_debug ("Initial fontconfig scan done, %u directories",
+                         g_hash_table_size (update->scan->dirs));
+                self->scan = g_steal_pointer (&update->scan);
+                g_debug ("Initial fontconfig scan took %.1f ms", update->scan_time / 1000.0);
+                update_result_free (update);
+
+                if (self->monitors) {
+                        fc_monitor_stop (self);
+                        fc_monitor_start (self);
+                }
+        } else if (update) {
                 g_debug ("Fontconfig update successful");
-                /* Remember we had a successful update even if we have to restart it */
+                /* Remember we had a successful update even if we have to restart it.
+                 * Changes are relative to the last notification so they accumulate. */
                 self->notify = TRUE;
+                g_clear_pointer (&self->pending, update_result_free);
+                self->pending = update;
         } else if (error) {
                 g_warning ("Fontconfig update failed: %s", error->message);
                 g_error_free (error);
-        } else
+                retry = !self->scan && self->monitors != NULL;
+        } else {
+                /* Nothing changed since the last notification */
                 g_debug ("Fontconfig update was unnecessary");
+                self->notify = FALSE;
+                g_clear_pointer (&self->pending, update_result_free);
+        }
 
         if (restart) {
                 g_debug ("Concurrent change: restarting fontconfig update timeout");
                 start_timeout (self);
+        } else if (retry) {
+                g_debug ("Retrying initial fontconfig scan in %d seconds", RETRY_SECONDS);
+                self->state = UPDATE_PENDING;
+                self->timeout = g_timeout_add_seconds (RETRY_SECONDS, start_update, self);
+                g_source_set_name_by_id (self->timeout, "[gnome-settings-daemon] retry");
         } else if (self->notify) {
                 self->notify = FALSE;
 
+                g_debug ("Fontconfig scan took %.1f ms, reinitialization %.1f ms",
+                         self->pending->scan_time / 1000.0,
+                         self->pending->reinit_time / 1000.0);
+
+                g_clear_pointer (&self->scan, scan_state_unref);
+                g_clear_pointer (&self->added, g_strfreev);
+                g_clear_pointer (&self->removed, g_strfreev);
+                self->scan_time = self->pending->scan_time;
+                self->reinit_time = self->pending->reinit_time;
+                self->scan = g_steal_pointer (&self->pending->scan);
+                self->added = g_steal_pointer (&self->pending->added);
+                self->removed = g_steal_pointer (&self->pending->removed);
+                g_clear_pointer (&self->pending, update_result_free);
+
                 if (self->monitors) {
                         fc_monitor_stop (self);
                         fc_monitor_start (self);
@@ -299,29 +885,17 @@ update_done (GObject *source_object G_GNUC_UNUSED,
                 /* we finish modifying self before emitting the signal,
                  * allowing the callback to stop us if it decides to. */
                 g_signal_emit (self, signals[SIGNAL_UPDATED], 0);
+
+                if (self->first_event_time) {
+                        g_debug ("Font change signalled %.1f ms after the first event, %u watches",
+                                 (g_get_monotonic_time () - self->first_event_time) / 1000.0,
+                                 self->monitors ? self->monitors->len : 0);
+                }
         }
 
+        if (!restart)
+                self->first_event_time = 0;
+
         /* release ref taken in start_update */
         g_object_unref (self);
 }
-
-#ifdef FONTCONFIG_MONITOR_TEST
-static void
-yay (void)
-{
-        g_message ("yay");
-}
-
-int
-main (void)
-{
-        GMainLoop *loop = g_main_loop_new (NULL, TRUE);
-        FcMonitor *monitor = fc_monitor_new ();
-
-        fc_monitor_start (monitor);
-        g_signal_connect (monitor, "updated", G_CALLBACK (yay), NULL);
-
-        g_main_loop_run (loop);
-        return 0;
-}
-#endif
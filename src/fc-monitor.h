@@ -19,7 +19,7 @@
 #ifndef FC_MONITOR_H
 #define FC_MONITOR_H
 
-/* NOTE: this file is copied from gnome-settings-daemon, please keep it in sync */
+/* NOTE: this file is based on gnome-settings-daemon's fc-monitor.h */
 
 #include <glib-object.h>
 
@@ -32,6 +32,15 @@ FcMonitor *fc_monitor_new (void);
 
 void fc_monitor_start (FcMonitor *monitor);
 void fc_monitor_stop  (FcMonitor *monitor);
+void fc_monitor_set_load_fonts (FcMonitor *monitor, gboolean load_fonts);
+
+const char * const *fc_monitor_get_added_families   (FcMonitor *monitor);
+const char * const *fc_monitor_get_removed_families (FcMonitor *monitor);
+
+guint fc_monitor_get_n_watches    (FcMonitor *monitor);
+void  fc_monitor_get_update_times (FcMonitor *monitor,
+                                   gint64    *scan_time,
+                                   gint64    *reinit_time);
 
 G_END_DECLS
 
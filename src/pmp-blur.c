@@ -0,0 +1,186 @@
+/*
+ * Copyright © 2024 The Phosh Developers
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "pmp-blur.h"
+
+/* Three box blurs approximate a gaussian one */
+#define BLUR_PASSES      3
+#define BLUR_MAX_THREADS 4
+/* Don't bother spawning threads for less work than that */
+#define BLUR_MIN_ROWS    64
+
+typedef struct {
+  const guint8 *src;
+  guint8       *dst;
+  int           stride;
+  int           width;
+  int           height;
+  int           n_channels;
+  int           radius;
+  /* The rows or byte columns to process */
+  int           start;
+  int           end;
+} BlurJob;
+
+/* 1 / (2 * radius + 1) in 16.16 fixed point */
+static guint32
+get_multiplier (int radius)
+{
+  return (65536 + radius) / (2 * radius + 1);
+}
+
+static gpointer
+blur_rows (gpointer data)
+{
+  BlurJob *job = data;
+  guint32 mul = get_multiplier (job->radius);
+  int n_channels = job->n_channels;
+  int width = job->width;
+  int radius = job->radius;
+  int x, y, c;
+
+  for (y = job->start; y < job->end; y++) {
+    const guint8 *src = job->src + (gsize) y * job->stride;
+    guint8 *dst = job->dst + (gsize) y * job->stride;
+
+    for (c = 0; c < n_channels; c++) {
+      guint32 sum = src[c] * (radius + 1);
+
+      for (x = 1; x <= radius; x++)
+        sum += src[MIN (x, width - 1) * n_channels + c];
+
+      for (x = 0; x < width; x++) {
+        dst[x * n_channels + c] = (sum * mul + 32768) >> 16;
+        sum += src[MIN (x + radius + 1, width - 1) * n_channels + c];
+        sum -= src[MAX (x - radius, 0) * n_channels + c];
+      }
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * Keeps a running sum per byte column and walks down the rows so the
+ * inner loops run over contiguous memory and get vectorized.
+ */
+static gpointer
+blur_columns (gpointer data)
+{
+  BlurJob *job = data;
+  guint32 mul = get_multiplier (job->radius);
+  int n = job->end - job->start;
+  int height = job->height;
+  int radius = job->radius;
+  const guint8 *src = job->src + job->start;
+  guint8 *dst = job->dst + job->start;
+  g_autofree guint32 *sums = g_new (guint32, n);
+  int i, y;
+
+  for (i = 0; i < n; i++)
+    sums[i] = src[i] * (radius + 1);
+
+  for (y = 1; y <= radius; y++) {
+    const guint8 *row = src + (gsize) MIN (y, height - 1) * job->stride;
+
+    for (i = 0; i < n; i++)
+      sums[i] += row[i];
+  }
+
+  for (y = 0; y < height; y++) {
+    const guint8 *add = src + (gsize) MIN (y + radius + 1, height - 1) * job->stride;
+    const guint8 *sub = src + (gsize) MAX (y - radius, 0) * job->stride;
+    guint8 *out = dst + (gsize) y * job->stride;
+
+    for (i = 0; i < n; i++) {
+      out[i] = (sums[i] * mul + 32768) >> 16;
+      sums[i] += add[i] - sub[i];
+    }
+  }
+
+  return NULL;
+}
+
+/* Runs the jobs in parallel, the first one on the calling thread */
+static void
+run_jobs (GThreadFunc func, BlurJob *jobs, int n_jobs)
+{
+  GThread *threads[BLUR_MAX_THREADS] = { NULL, };
+  int i;
+
+  for (i = 1; i < n_jobs; i++) {
+    threads[i] = g_thread_try_new ("pmp-blur", func, &jobs[i], NULL);
+    if (!threads[i])
+      func (&jobs[i]);
+  }
+
+  func (&jobs[0]);
+
+  for (i = 1; i < n_jobs; i++) {
+    if (threads[i])
+      g_thread_join (threads[i]);
+  }
+}
+
+static void
+split_jobs (BlurJob *jobs, int n_jobs, const BlurJob *template, int total)
+{
+  int i;
+
+  for (i = 0; i < n_jobs; i++) {
+    jobs[i] = *template;
+    jobs[i].start = total * i / n_jobs;
+    jobs[i].end = total * (i + 1) / n_jobs;
+  }
+}
+
+/**
+ * pmp_blur_pixbuf:
+ * @pixbuf: The pixbuf to blur
+ * @radius: The blur radius in pixels
+ *
+ * Blurs @pixbuf in place with an approximated gaussian blur, spreading
+ * the work over several threads for larger images.
+ */
+void
+pmp_blur_pixbuf (GdkPixbuf *pixbuf, int radius)
+{
+  BlurJob jobs[BLUR_MAX_THREADS];
+  BlurJob template;
+  g_autofree guint8 *tmp = NULL;
+  guint8 *pixels;
+  int n_threads, pass;
+
+  g_return_if_fail (GDK_IS_PIXBUF (pixbuf));
+  g_return_if_fail (gdk_pixbuf_get_bits_per_sample (pixbuf) == 8);
+
+  if (radius <= 0)
+    return;
+
+  pixels = gdk_pixbuf_get_pixels (pixbuf);
+  tmp = g_malloc (gdk_pixbuf_get_byte_length (pixbuf));
+
+  template.stride = gdk_pixbuf_get_rowstride (pixbuf);
+  template.width = gdk_pixbuf_get_width (pixbuf);
+  template.height = gdk_pixbuf_get_height (pixbuf);
+  template.n_channels = gdk_pixbuf_get_n_channels (pixbuf);
+  template.radius = radius;
+
+  n_threads = MIN ((int) g_get_num_processors (), template.height / BLUR_MIN_ROWS);
+  n_threads = CLAMP (n_threads, 1, BLUR_MAX_THREADS);
+
+  for (pass = 0; pass < BLUR_PASSES; pass++) {
+    template.src = pixels;
+    template.dst = tmp;
+    split_jobs (jobs, n_threads, &template, template.height);
+    run_jobs (blur_rows, jobs, n_threads);
+
+    template.src = tmp;
+    template.dst = pixels;
+    split_jobs (jobs, n_threads, &template, template.width * template.n_channels);
+    run_jobs (blur_columns, jobs, n_threads);
+  }
+}
@@ -0,0 +1,15 @@
+/*
+ * Copyright © 2024 The Phosh Developers
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+G_BEGIN_DECLS
+
+void pmp_blur_pixbuf (GdkPixbuf *pixbuf, int radius);
+
+G_END_DECLS
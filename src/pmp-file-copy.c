@@ -0,0 +1,278 @@
+/*
+ * Copyright © 2024 The Phosh Developers
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define _GNU_SOURCE 1
+
+#include "pmp-config.h"
+
+#include "pmp-file-copy.h"
+#include "pmp-io-pool.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+
+#include <glib/gstdio.h>
+
+/* Upper bound for a single kernel side copy so we can check for cancellation */
+#define COPY_CHUNK_SIZE  (8 * 1024 * 1024)
+/* Buffer size when we have to copy through user space */
+#define COPY_BUFFER_SIZE (64 * 1024)
+
+typedef enum {
+  COPY_METHOD_COPY_FILE_RANGE,
+  COPY_METHOD_SENDFILE,
+  COPY_METHOD_READ_WRITE,
+} CopyMethod;
+
+static gboolean
+set_error_from_errno (GError **error, int saved_errno, const char *what)
+{
+  g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+               "%s failed: %s", what, g_strerror (saved_errno));
+  return FALSE;
+}
+
+static gboolean
+copy_read_write (int in_fd, int out_fd, GCancellable *cancellable, GError **error)
+{
+  g_autofree char *buffer = g_malloc (COPY_BUFFER_SIZE);
+
+  while (TRUE) {
+    gssize n_read;
+    gssize offset = 0;
+
+    if (g_cancellable_set_error_if_cancelled (cancellable, error))
+      return FALSE;
+
+    n_read = read (in_fd, buffer, COPY_BUFFER_SIZE);
+    if (n_read < 0) {
+      if (errno == EINTR)
+        continue;
+      return set_error_from_errno (error, errno, "read");
+    }
+    if (n_read == 0)
+      return TRUE;
+
+    while (offset < n_read) {
+      gssize n_written = write (out_fd, buffer + offset, n_read - offset);
+
+      if (n_written < 0) {
+        if (errno == EINTR)
+          continue;
+        return set_error_from_errno (error, errno, "write");
+      }
+      offset += n_written;
+    }
+  }
+}
+
+/*
+ * Copies @in_fd to @out_fd without going through user space: try to
+ * share the data blocks first (reflink), then let the kernel copy
+ * (copy_file_range, sendfile) and fall back to a bounded buffer.
+ */
+static gboolean
+copy_fd (int in_fd, int out_fd, GCancellable *cancellable, GError **error)
+{
+  CopyMethod method = COPY_METHOD_COPY_FILE_RANGE;
+  gboolean copied_any = FALSE;
+
+  if (ioctl (out_fd, FICLONE, in_fd) == 0) {
+    g_debug ("Copied via reflink");
+    return TRUE;
+  }
+
+  while (method != COPY_METHOD_READ_WRITE) {
+    gssize n_copied;
+
+    if (g_cancellable_set_error_if_cancelled (cancellable, error))
+      return FALSE;
+
+    if (method == COPY_METHOD_COPY_FILE_RANGE)
+      n_copied = copy_file_range (in_fd, NULL, out_fd, NULL, COPY_CHUNK_SIZE, 0);
+    else
+      n_copied = sendfile (out_fd, in_fd, NULL, COPY_CHUNK_SIZE);
+
+    if (n_copied == 0)
+      return TRUE;
+
+    if (n_copied > 0) {
+      copied_any = TRUE;
+      continue;
+    }
+
+    if (errno == EINTR)
+      continue;
+
+    /* Unsupported for this pair of files, try the next method if nothing was copied yet */
+    if (!copied_any && (errno == EXDEV || errno == ENOSYS || errno == EINVAL ||
+                        errno == EOPNOTSUPP || errno == EBADF)) {
+      method = method == COPY_METHOD_COPY_FILE_RANGE ? COPY_METHOD_SENDFILE :
+                                                       COPY_METHOD_READ_WRITE;
+      continue;
+    }
+
+    return set_error_from_errno (error, errno,
+                                 method == COPY_METHOD_COPY_FILE_RANGE ? "copy_file_range" : "sendfile");
+  }
+
+  return copy_read_write (in_fd, out_fd, cancellable, error);
+}
+
+static gboolean
+copy_local (const char   *source_path,
+            const char   *destination_path,
+            GCancellable *cancellable,
+            GError      **error)
+{
+  g_autofree char *dirname = g_path_get_dirname (destination_path);
+  g_autofree char *basename = g_path_get_basename (destination_path);
+  g_autofree char *tmp_name = NULL;
+  g_autofree char *tmp_path = NULL;
+  int in_fd, out_fd;
+  gboolean success = FALSE;
+
+  in_fd = g_open (source_path, O_RDONLY | O_CLOEXEC, 0);
+  if (in_fd < 0)
+    return set_error_from_errno (error, errno, "open");
+
+  /* Write to a temporary file next to the destination and rename it into place */
+  tmp_name = g_strdup_printf (".%s-XXXXXX", basename);
+  tmp_path = g_build_filename (dirname, tmp_name, NULL);
+  out_fd = g_mkstemp_full (tmp_path, O_WRONLY | O_CLOEXEC, 0644);
+  if (out_fd < 0) {
+    set_error_from_errno (error, errno, "mkstemp");
+    close (in_fd);
+    return FALSE;
+  }
+
+  if (!copy_fd (in_fd, out_fd, cancellable, error))
+    goto out;
+
+  if (fdatasync (out_fd) < 0) {
+    set_error_from_errno (error, errno, "fdatasync");
+    goto out;
+  }
+
+  if (g_rename (tmp_path, destination_path) < 0) {
+    set_error_from_errno (error, errno, "rename");
+    goto out;
+  }
+
+  success = TRUE;
+
+out:
+  close (in_fd);
+  close (out_fd);
+  if (!success)
+    g_unlink (tmp_path);
+
+  return success;
+}
+
+static gboolean
+copy_streams (GFile        *source,
+              GFile        *destination,
+              GCancellable *cancellable,
+              GError      **error)
+{
+  g_autoptr (GFileInputStream) in = NULL;
+  g_autoptr (GFileOutputStream) out = NULL;
+
+  in = g_file_read (source, cancellable, error);
+  if (!in)
+    return FALSE;
+
+  out = g_file_replace (destination, NULL, FALSE, G_FILE_CREATE_REPLACE_DESTINATION,
+                        cancellable, error);
+  if (!out)
+    return FALSE;
+
+  return g_output_stream_splice (G_OUTPUT_STREAM (out),
+                                 G_INPUT_STREAM (in),
+                                 G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE |
+                                 G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET,
+                                 cancellable,
+                                 error) >= 0;
+}
+
+/**
+ * pmp_file_copy:
+ * @source: The file to copy
+ * @destination: Where to copy it to
+ * @cancellable: (nullable): A cancellable
+ * @error: Return location for an error
+ *
+ * Atomically replaces @destination with the contents of @source. Memory
+ * use is bounded independent of the file size. This blocks so only use
+ * it off the main thread.
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+pmp_file_copy (GFile         *source,
+               GFile         *destination,
+               GCancellable  *cancellable,
+               GError       **error)
+{
+  g_autofree char *source_path = g_file_get_path (source);
+  g_autofree char *destination_path = g_file_get_path (destination);
+
+  if (source_path && destination_path)
+    return copy_local (source_path, destination_path, cancellable, error);
+
+  return copy_streams (source, destination, cancellable, error);
+}
+
+static void
+copy_thread (GTask        *task,
+             gpointer      source_object,
+             gpointer      task_data,
+             GCancellable *cancellable)
+{
+  GFile *destination = task_data;
+  GError *error = NULL;
+
+  if (!pmp_file_copy (G_FILE (source_object), destination, cancellable, &error)) {
+    g_task_return_error (task, error);
+    return;
+  }
+
+  g_task_return_boolean (task, TRUE);
+}
+
+void
+pmp_file_copy_async (GFile               *source,
+                     GFile               *destination,
+                     int                  io_priority,
+                     GCancellable        *cancellable,
+                     GAsyncReadyCallback  callback,
+                     gpointer             user_data)
+{
+  g_autoptr (GTask) task = NULL;
+
+  g_return_if_fail (G_IS_FILE (source));
+  g_return_if_fail (G_IS_FILE (destination));
+
+  task = g_task_new (source, cancellable, callback, user_data);
+  g_task_set_source_tag (task, pmp_file_copy_async);
+  g_task_set_priority (task, io_priority);
+  g_task_set_task_data (task, g_object_ref (destination), g_object_unref);
+  pmp_io_pool_run (task, copy_thread);
+}
+
+gboolean
+pmp_file_copy_finish (GAsyncResult  *result,
+                      GError       **error)
+{
+  g_return_val_if_fail (g_task_get_source_tag (G_TASK (result)) == pmp_file_copy_async, FALSE);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
@@ -0,0 +1,26 @@
+/*
+ * Copyright © 2024 The Phosh Developers
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+gboolean pmp_file_copy        (GFile                *source,
+                               GFile                *destination,
+                               GCancellable         *cancellable,
+                               GError              **error);
+void     pmp_file_copy_async  (GFile                *source,
+                               GFile                *destination,
+                               int                   io_priority,
+                               GCancellable         *cancellable,
+                               GAsyncReadyCallback   callback,
+                               gpointer              user_data);
+gboolean pmp_file_copy_finish (GAsyncResult         *result,
+                               GError              **error);
+
+G_END_DECLS
@@ -0,0 +1,235 @@
+/*
+ * Copyright © 2024 The Phosh Developers
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "pmp-config.h"
+
+#include "pmp-image-probe.h"
+#include "pmp-io-pool.h"
+
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+#define PROBE_CHUNK_SIZE 4096
+/* Enough to get past large EXIF blocks in camera JPEGs */
+#define PROBE_MAX_SIZE   (256 * 1024)
+
+typedef struct {
+  PmpImageLimits limits;
+  int            width;
+  int            height;
+  gboolean       prepared;
+} ProbeData;
+
+static void
+on_size_prepared (GdkPixbufLoader *loader, int width, int height, ProbeData *data)
+{
+  data->width = width;
+  data->height = height;
+  data->prepared = TRUE;
+
+  /* We only want the size, let loaders that can scale at decode time skip the pixels */
+  gdk_pixbuf_loader_set_size (loader, 1, 1);
+}
+
+static void
+on_start_element (GMarkupParseContext  *context,
+                  const char           *element_name,
+                  const char          **attribute_names,
+                  const char          **attribute_values,
+                  gpointer              user_data,
+                  GError              **error)
+{
+  gboolean *is_background = user_data;
+
+  *is_background = g_str_equal (element_name, "background");
+
+  /* Only the root element matters, stop parsing */
+  g_set_error_literal (error, G_MARKUP_ERROR, G_MARKUP_ERROR_PARSE, "Got root element");
+}
+
+/* gnome-bg also handles XML slideshows which gdk-pixbuf can't probe */
+static gboolean
+is_slideshow (const guchar *buffer, gsize len)
+{
+  const GMarkupParser parser = { .start_element = on_start_element };
+  g_autofree char *content_type = g_content_type_guess (NULL, buffer, len, NULL);
+  g_autoptr (GMarkupParseContext) context = NULL;
+  gboolean is_background = FALSE;
+
+  if (!g_content_type_is_a (content_type, "application/xml"))
+    return FALSE;
+
+  /* Slideshows have a <background> root element */
+  context = g_markup_parse_context_new (&parser, G_MARKUP_IGNORE_QUALIFIED, &is_background, NULL);
+  g_markup_parse_context_parse (context, (const char *) buffer, len, NULL);
+
+  return is_background;
+}
+
+/* Some loaders (e.g. TIFF) only know the size once they got the whole
+ * file, let gdk-pixbuf read it without decoding the pixels */
+static gboolean
+probe_file_info (GFile *file, ProbeData *data)
+{
+  g_autofree char *path = g_file_get_path (file);
+
+  if (!path)
+    return FALSE;
+
+  if (!gdk_pixbuf_get_file_info (path, &data->width, &data->height))
+    return FALSE;
+
+  data->prepared = TRUE;
+  return TRUE;
+}
+
+static gboolean
+probe (GFile *file, ProbeData *data, GCancellable *cancellable, GError **error)
+{
+  g_autoptr (GFileInfo) info = NULL;
+  g_autoptr (GFileInputStream) stream = NULL;
+  g_autoptr (GdkPixbufLoader) loader = NULL;
+  g_autoptr (GError) err = NULL;
+  guchar buffer[PROBE_CHUNK_SIZE];
+  gsize total = 0;
+  goffset size;
+  gboolean success = TRUE;
+
+  info = g_file_query_info (file,
+                            G_FILE_ATTRIBUTE_STANDARD_TYPE "," G_FILE_ATTRIBUTE_STANDARD_SIZE,
+                            G_FILE_QUERY_INFO_NONE,
+                            cancellable,
+                            error);
+  if (!info)
+    return FALSE;
+
+  if (g_file_info_get_file_type (info) != G_FILE_TYPE_REGULAR) {
+    g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_REGULAR_FILE, "Not a regular file");
+    return FALSE;
+  }
+
+  size = g_file_info_get_size (info);
+  if (size > data->limits.max_file_size) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                 "File too large: %" G_GOFFSET_FORMAT " bytes", size);
+    return FALSE;
+  }
+
+  stream = g_file_read (file, cancellable, error);
+  if (!stream)
+    return FALSE;
+
+  loader = gdk_pixbuf_loader_new ();
+  g_signal_connect (loader, "size-prepared", G_CALLBACK (on_size_prepared), data);
+
+  while (!data->prepared && total < PROBE_MAX_SIZE) {
+    gssize n_read = g_input_stream_read (G_INPUT_STREAM (stream), buffer, sizeof (buffer),
+                                         cancellable, error);
+    if (n_read < 0) {
+      success = FALSE;
+      break;
+    }
+
+    if (n_read == 0)
+      break;
+
+    if (total == 0 && is_slideshow (buffer, n_read)) {
+      gdk_pixbuf_loader_close (loader, NULL);
+      return TRUE;
+    }
+
+    if (!gdk_pixbuf_loader_write (loader, buffer, n_read, &err)) {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Not an image: %s", err->message);
+      success = FALSE;
+      break;
+    }
+    total += n_read;
+  }
+
+  /* We usually stop early so the loader complains about truncated data */
+  gdk_pixbuf_loader_close (loader, NULL);
+
+  if (!success)
+    return FALSE;
+
+  if (!data->prepared && g_cancellable_set_error_if_cancelled (cancellable, error))
+    return FALSE;
+
+  if (!data->prepared && !probe_file_info (file, data)) {
+    g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Could not determine image size");
+    return FALSE;
+  }
+
+  if (data->width > data->limits.max_dimension || data->height > data->limits.max_dimension ||
+      (guint64) data->width * data->height > data->limits.max_pixels) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                 "Image too large: %dx%d pixels", data->width, data->height);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static void
+probe_thread (GTask        *task,
+              gpointer      source_object,
+              gpointer      task_data,
+              GCancellable *cancellable)
+{
+  GError *error = NULL;
+
+  if (!probe (G_FILE (source_object), task_data, cancellable, &error)) {
+    g_task_return_error (task, error);
+    return;
+  }
+
+  g_task_return_boolean (task, TRUE);
+}
+
+/**
+ * pmp_image_probe_async:
+ * @file: The file to check
+ * @limits: The limits to check against
+ * @io_priority: The I/O priority
+ * @cancellable: (nullable): A cancellable
+ * @callback: The callback to invoke when done
+ * @user_data: The data passed to the callback
+ *
+ * Checks that @file is an image (or slideshow) within @limits. Only
+ * the first few KB are read so this fails fast on files we don't want
+ * to copy or decode.
+ */
+void
+pmp_image_probe_async (GFile                *file,
+                       const PmpImageLimits *limits,
+                       int                   io_priority,
+                       GCancellable         *cancellable,
+                       GAsyncReadyCallback   callback,
+                       gpointer              user_data)
+{
+  g_autoptr (GTask) task = NULL;
+  ProbeData *data;
+
+  g_return_if_fail (G_IS_FILE (file));
+  g_return_if_fail (limits);
+
+  data = g_new0 (ProbeData, 1);
+  data->limits = *limits;
+
+  task = g_task_new (file, cancellable, callback, user_data);
+  g_task_set_source_tag (task, pmp_image_probe_async);
+  g_task_set_priority (task, io_priority);
+  g_task_set_task_data (task, data, g_free);
+  pmp_io_pool_run (task, probe_thread);
+}
+
+gboolean
+pmp_image_probe_finish (GAsyncResult  *result,
+                        GError       **error)
+{
+  g_return_val_if_fail (g_task_get_source_tag (G_TASK (result)) == pmp_image_probe_async, FALSE);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
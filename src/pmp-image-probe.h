@@ -0,0 +1,36 @@
+/*
+ * Copyright © 2024 The Phosh Developers
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/**
+ * PmpImageLimits:
+ * @max_file_size: The maximum file size in bytes
+ * @max_pixels: The maximum number of pixels
+ * @max_dimension: The maximum width or height in pixels
+ *
+ * Limits for images we're willing to process.
+ */
+typedef struct {
+  guint64 max_file_size;
+  guint64 max_pixels;
+  guint   max_dimension;
+} PmpImageLimits;
+
+void     pmp_image_probe_async  (GFile                 *file,
+                                 const PmpImageLimits  *limits,
+                                 int                    io_priority,
+                                 GCancellable          *cancellable,
+                                 GAsyncReadyCallback    callback,
+                                 gpointer               user_data);
+gboolean pmp_image_probe_finish (GAsyncResult          *result,
+                                 GError               **error);
+
+G_END_DECLS
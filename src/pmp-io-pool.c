@@ -0,0 +1,75 @@
+/*
+ * Copyright © 2024 The Phosh Developers
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "pmp-config.h"
+
+#include "pmp-io-pool.h"
+
+/* Slow storage doesn't get faster with more concurrent writers */
+#define IO_POOL_MAX_THREADS 2
+
+typedef struct {
+  GTask           *task;
+  GTaskThreadFunc  task_func;
+} IoPoolJob;
+
+static GThreadPool *io_pool;
+
+static void
+io_pool_job_run (gpointer data, gpointer user_data)
+{
+  IoPoolJob *job = data;
+
+  job->task_func (job->task,
+                  g_task_get_source_object (job->task),
+                  g_task_get_task_data (job->task),
+                  g_task_get_cancellable (job->task));
+
+  g_object_unref (job->task);
+  g_free (job);
+}
+
+static int
+io_pool_job_compare (gconstpointer a, gconstpointer b, gpointer user_data)
+{
+  const IoPoolJob *job_a = a;
+  const IoPoolJob *job_b = b;
+
+  return g_task_get_priority (job_a->task) - g_task_get_priority (job_b->task);
+}
+
+/**
+ * pmp_io_pool_run:
+ * @task: The task to run
+ * @task_func: The function doing the work
+ *
+ * Like `g_task_run_in_thread()` but runs @task_func in a small, bounded
+ * pool dedicated to disk I/O so slow storage can't exhaust GLib's
+ * shared pool. Jobs are started in order of the task's priority.
+ * @task_func must return a value on @task, @task's callback then runs
+ * in the main context the task was created in.
+ */
+void
+pmp_io_pool_run (GTask *task, GTaskThreadFunc task_func)
+{
+  IoPoolJob *job;
+
+  g_return_if_fail (G_IS_TASK (task));
+
+  if (g_once_init_enter (&io_pool)) {
+    GThreadPool *pool = g_thread_pool_new (io_pool_job_run, NULL, IO_POOL_MAX_THREADS,
+                                           FALSE, NULL);
+
+    g_thread_pool_set_sort_function (pool, io_pool_job_compare, NULL);
+    g_once_init_leave (&io_pool, pool);
+  }
+
+  job = g_new0 (IoPoolJob, 1);
+  job->task = g_object_ref (task);
+  job->task_func = task_func;
+
+  g_thread_pool_push (io_pool, job, NULL);
+}
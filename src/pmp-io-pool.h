@@ -0,0 +1,15 @@
+/*
+ * Copyright © 2024 The Phosh Developers
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+void pmp_io_pool_run (GTask *task, GTaskThreadFunc task_func);
+
+G_END_DECLS
@@ -0,0 +1,224 @@
+/*
+ * Copyright © 2024 The Phosh Developers
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "pmp-config.h"
+
+#include "pmp-palette.h"
+
+#include <stdio.h>
+
+#define PALETTE_GROUP       "Palette"
+#define PALETTE_KEY_COLORS  "Colors"
+
+/* The image is sampled down to at most that many pixels per side */
+#define PALETTE_SAMPLE_SIZE 64
+/* Bits per channel of the histogram */
+#define PALETTE_BITS        4
+#define PALETTE_BINS        (1 << (3 * PALETTE_BITS))
+/* Squared distance (in 8 bit per channel RGB) below which colors count as the same */
+#define PALETTE_MIN_DISTANCE (48 * 48)
+
+typedef struct {
+  guint32 count;
+  guint32 red;
+  guint32 green;
+  guint32 blue;
+} Bin;
+
+static int
+compare_bins_by_count (gconstpointer a, gconstpointer b, gpointer data)
+{
+  const Bin *bins = data;
+  guint32 count_a = bins[*(const guint16 *)a].count;
+  guint32 count_b = bins[*(const guint16 *)b].count;
+
+  if (count_a == count_b)
+    return 0;
+
+  return count_a < count_b ? 1 : -1;
+}
+
+static gboolean
+is_distinct (GArray *palette, int red, int green, int blue)
+{
+  guint i;
+
+  for (i = 0; i < palette->len; i++) {
+    PmpPaletteColor *color = &g_array_index (palette, PmpPaletteColor, i);
+    int dr = red - (int) (color->red * 255.0 + 0.5);
+    int dg = green - (int) (color->green * 255.0 + 0.5);
+    int db = blue - (int) (color->blue * 255.0 + 0.5);
+
+    if (dr * dr + dg * dg + db * db < PALETTE_MIN_DISTANCE)
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+/**
+ * pmp_palette_extract:
+ * @pixbuf: The image
+ * @max_colors: The maximum number of colors to extract
+ *
+ * Extracts the dominant colors of @pixbuf from a color histogram of a
+ * downsampled copy. Similar colors are merged, transparent pixels
+ * ignored.
+ *
+ * Returns: (transfer full) (element-type PmpPaletteColor): The colors,
+ *   most dominant first
+ */
+GArray *
+pmp_palette_extract (GdkPixbuf *pixbuf, guint max_colors)
+{
+  GArray *palette = g_array_new (FALSE, FALSE, sizeof (PmpPaletteColor));
+  g_autoptr (GdkPixbuf) sample = NULL;
+  g_autofree Bin *bins = g_new0 (Bin, PALETTE_BINS);
+  g_autofree guint16 *order = g_new (guint16, PALETTE_BINS);
+  int width, height, stride, n_channels, x, y;
+  gboolean has_alpha;
+  const guint8 *pixels;
+  double scale;
+  guint i, n_used = 0;
+
+  g_return_val_if_fail (GDK_IS_PIXBUF (pixbuf), palette);
+
+  width = gdk_pixbuf_get_width (pixbuf);
+  height = gdk_pixbuf_get_height (pixbuf);
+  scale = MIN (1.0, (double) PALETTE_SAMPLE_SIZE / MAX (width, height));
+  sample = gdk_pixbuf_scale_simple (pixbuf,
+                                    MAX (1, (int) (width * scale)),
+                                    MAX (1, (int) (height * scale)),
+                                    GDK_INTERP_BILINEAR);
+  if (!sample)
+    return palette;
+
+  width = gdk_pixbuf_get_width (sample);
+  height = gdk_pixbuf_get_height (sample);
+  stride = gdk_pixbuf_get_rowstride (sample);
+  n_channels = gdk_pixbuf_get_n_channels (sample);
+  has_alpha = gdk_pixbuf_get_has_alpha (sample);
+  pixels = gdk_pixbuf_read_pixels (sample);
+
+  for (y = 0; y < height; y++) {
+    const guint8 *row = pixels + (gsize) y * stride;
+
+    for (x = 0; x < width; x++) {
+      const guint8 *p = row + x * n_channels;
+      guint index;
+
+      if (has_alpha && p[3] < 128)
+        continue;
+
+      index = ((p[0] >> (8 - PALETTE_BITS)) << (2 * PALETTE_BITS)) |
+              ((p[1] >> (8 - PALETTE_BITS)) << PALETTE_BITS) |
+              (p[2] >> (8 - PALETTE_BITS));
+      bins[index].count++;
+      bins[index].red += p[0];
+      bins[index].green += p[1];
+      bins[index].blue += p[2];
+    }
+  }
+
+  for (i = 0; i < PALETTE_BINS; i++) {
+    if (bins[i].count)
+      order[n_used++] = i;
+  }
+  g_qsort_with_data (order, n_used, sizeof (guint16), compare_bins_by_count, bins);
+
+  for (i = 0; i < n_used && palette->len < max_colors; i++) {
+    Bin *bin = &bins[order[i]];
+    int red = bin->red / bin->count;
+    int green = bin->green / bin->count;
+    int blue = bin->blue / bin->count;
+    PmpPaletteColor color;
+
+    if (!is_distinct (palette, red, green, blue))
+      continue;
+
+    color.red = red / 255.0;
+    color.green = green / 255.0;
+    color.blue = blue / 255.0;
+    g_array_append_val (palette, color);
+  }
+
+  return palette;
+}
+
+/**
+ * pmp_palette_save:
+ * @palette: (element-type PmpPaletteColor): The palette
+ * @path: Where to save it
+ * @error: Return location for an error
+ *
+ * Atomically saves @palette to @path.
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+pmp_palette_save (GArray *palette, const char *path, GError **error)
+{
+  g_autoptr (GKeyFile) keyfile = g_key_file_new ();
+  g_autoptr (GPtrArray) colors = g_ptr_array_new_with_free_func (g_free);
+  guint i;
+
+  for (i = 0; i < palette->len; i++) {
+    PmpPaletteColor *color = &g_array_index (palette, PmpPaletteColor, i);
+
+    g_ptr_array_add (colors, g_strdup_printf ("#%02x%02x%02x",
+                                              (guint) (color->red * 255.0 + 0.5),
+                                              (guint) (color->green * 255.0 + 0.5),
+                                              (guint) (color->blue * 255.0 + 0.5)));
+  }
+
+  g_key_file_set_string_list (keyfile, PALETTE_GROUP, PALETTE_KEY_COLORS,
+                              (const char * const *) colors->pdata, colors->len);
+
+  return g_key_file_save_to_file (keyfile, path, error);
+}
+
+/**
+ * pmp_palette_load:
+ * @path: The file to load the palette from
+ * @error: Return location for an error
+ *
+ * Loads a palette saved with [func@palette_save].
+ *
+ * Returns: (transfer full) (element-type PmpPaletteColor) (nullable): The palette
+ */
+GArray *
+pmp_palette_load (const char *path, GError **error)
+{
+  g_autoptr (GKeyFile) keyfile = g_key_file_new ();
+  g_autoptr (GArray) palette = g_array_new (FALSE, FALSE, sizeof (PmpPaletteColor));
+  g_auto (GStrv) colors = NULL;
+  guint i;
+
+  if (!g_key_file_load_from_file (keyfile, path, G_KEY_FILE_NONE, error))
+    return NULL;
+
+  colors = g_key_file_get_string_list (keyfile, PALETTE_GROUP, PALETTE_KEY_COLORS, NULL, error);
+  if (!colors)
+    return NULL;
+
+  for (i = 0; colors[i]; i++) {
+    PmpPaletteColor color;
+    guint red, green, blue;
+
+    if (sscanf (colors[i], "#%02x%02x%02x", &red, &green, &blue) != 3) {
+      g_set_error (error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_INVALID_VALUE,
+                   "Invalid color '%s'", colors[i]);
+      return NULL;
+    }
+
+    color.red = red / 255.0;
+    color.green = green / 255.0;
+    color.blue = blue / 255.0;
+    g_array_append_val (palette, color);
+  }
+
+  return g_steal_pointer (&palette);
+}
@@ -0,0 +1,35 @@
+/*
+ * Copyright © 2024 The Phosh Developers
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+G_BEGIN_DECLS
+
+/**
+ * PmpPaletteColor:
+ * @red: The red component in the range [0, 1]
+ * @green: The green component in the range [0, 1]
+ * @blue: The blue component in the range [0, 1]
+ *
+ * A color of a palette.
+ */
+typedef struct {
+  double red;
+  double green;
+  double blue;
+} PmpPaletteColor;
+
+GArray  *pmp_palette_extract (GdkPixbuf   *pixbuf,
+                              guint        max_colors);
+gboolean pmp_palette_save    (GArray      *palette,
+                              const char  *path,
+                              GError     **error);
+GArray  *pmp_palette_load    (const char  *path,
+                              GError     **error);
+
+G_END_DECLS
@@ -25,18 +25,132 @@
 
 static void request_skeleton_iface_init (PmpImplRequestIface *iface);
 
+/* Exported requests by handle, holding the export reference */
+static GHashTable *requests;
+/* NameOwnerChanged subscriptions by sender with exported requests */
+static GHashTable *sender_watches;
+
+typedef struct {
+  GDBusConnection *connection;
+  guint            subscription_id;
+  guint            n_requests;
+} SenderWatch;
+
 G_DEFINE_TYPE_WITH_CODE (Request, request, PMP_IMPL_TYPE_REQUEST_SKELETON,
                          G_IMPLEMENT_INTERFACE (PMP_IMPL_TYPE_REQUEST, request_skeleton_iface_init))
 
+/*
+ * Cancels the request's in-flight work. Implementations listen to the
+ * cancellable to tear down their UI and per request state.
+ */
+static void
+request_close (Request *request)
+{
+  g_autoptr (Request) self = g_object_ref (request);
+
+  g_debug ("Closing request %s", request->id);
+  g_cancellable_cancel (request->cancellable);
+
+  if (request->exported)
+    request_unexport (request);
+}
+
+static void
+on_name_owner_changed (GDBusConnection *connection,
+                       const char      *sender_name,
+                       const char      *object_path,
+                       const char      *interface_name,
+                       const char      *signal_name,
+                       GVariant        *parameters,
+                       gpointer         user_data)
+{
+  g_autoptr (GPtrArray) vanished = NULL;
+  const char *name, *from, *to;
+  GHashTableIter iter;
+  Request *request;
+  guint i;
+
+  g_variant_get (parameters, "(&s&s&s)", &name, &from, &to);
+  if (to[0] != '\0' || !requests)
+    return;
+
+  vanished = g_ptr_array_new_with_free_func (g_object_unref);
+  g_hash_table_iter_init (&iter, requests);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&request)) {
+    if (g_strcmp0 (request->sender, name) == 0)
+      g_ptr_array_add (vanished, g_object_ref (request));
+  }
+
+  for (i = 0; i < vanished->len; i++)
+    request_close (g_ptr_array_index (vanished, i));
+}
+
+static void
+sender_watch_free (SenderWatch *watch)
+{
+  g_dbus_connection_signal_unsubscribe (watch->connection, watch->subscription_id);
+  g_object_unref (watch->connection);
+  g_free (watch);
+}
+
+/* Clean up after senders that leave the bus without closing their requests */
+static void
+watch_sender (Request *request, GDBusConnection *connection)
+{
+  SenderWatch *watch;
+
+  if (!request->sender)
+    return;
+
+  if (!sender_watches) {
+    sender_watches = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                            (GDestroyNotify) sender_watch_free);
+  }
+
+  watch = g_hash_table_lookup (sender_watches, request->sender);
+  if (!watch) {
+    watch = g_new0 (SenderWatch, 1);
+    watch->connection = g_object_ref (connection);
+    /* Only wake up for this sender, not every name change on the bus */
+    watch->subscription_id = g_dbus_connection_signal_subscribe (connection,
+                                                                 "org.freedesktop.DBus",
+                                                                 "org.freedesktop.DBus",
+                                                                 "NameOwnerChanged",
+                                                                 "/org/freedesktop/DBus",
+                                                                 request->sender,
+                                                                 G_DBUS_SIGNAL_FLAGS_NONE,
+                                                                 on_name_owner_changed,
+                                                                 NULL,
+                                                                 NULL);
+    g_hash_table_insert (sender_watches, g_strdup (request->sender), watch);
+  }
+
+  watch->n_requests++;
+}
+
+static void
+unwatch_sender (Request *request)
+{
+  SenderWatch *watch;
+
+  if (!request->sender || !sender_watches)
+    return;
+
+  watch = g_hash_table_lookup (sender_watches, request->sender);
+  if (!watch)
+    return;
+
+  if (--watch->n_requests == 0)
+    g_hash_table_remove (sender_watches, request->sender);
+}
+
 static gboolean
 handle_close (PmpImplRequest        *object,
               GDBusMethodInvocation *invocation)
 {
   Request *request = (Request *)object;
-  g_autoptr (GError) error = NULL;
 
-  if (request->exported)
-    request_unexport (request);
+  request_close (request);
 
   pmp_impl_request_complete_close (PMP_IMPL_REQUEST (request), invocation);
 
@@ -52,6 +166,7 @@ request_skeleton_iface_init (PmpImplRequestIface *iface)
 static void
 request_init (Request *request)
 {
+  request->cancellable = g_cancellable_new ();
 }
 
 static void
@@ -59,6 +174,7 @@ request_finalize (GObject *object)
 {
   Request *request = (Request *)object;
 
+  g_clear_object (&request->cancellable);
   g_free (request->sender);
   g_free (request->app_id);
   g_free (request->id);
@@ -106,12 +222,21 @@ request_export (Request         *request,
 
   g_object_ref (request);
   request->exported = TRUE;
+
+  if (!requests)
+    requests = g_hash_table_new (g_str_hash, g_str_equal);
+  g_hash_table_insert (requests, request->id, request);
+
+  watch_sender (request, connection);
 }
 
 void
 request_unexport (Request *request)
 {
   request->exported = FALSE;
+  if (requests)
+    g_hash_table_remove (requests, request->id);
+  unwatch_sender (request);
   g_dbus_interface_skeleton_unexport (G_DBUS_INTERFACE_SKELETON (request));
   g_object_unref (request);
 }
@@ -30,6 +30,7 @@ struct _Request {
   PmpImplRequestSkeleton parent_instance;
 
   gboolean               exported;
+  GCancellable          *cancellable;
   char                  *sender;
   char                  *app_id;
   char                  *id;
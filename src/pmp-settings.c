@@ -17,17 +17,28 @@
 #include <glib/gi18n.h>
 #include <gio/gio.h>
 #include <gdesktop-enums.h>
+#include <pango/pangocairo.h>
 
+#include "pmp-palette.h"
 #include "pmp-settings.h"
 #include "pmp-utils.h"
+#include "pmp-wallpaper-store.h"
 
 #include "xdg-desktop-portal-dbus.h"
 #include "fc-monitor.h"
 
+#define FONTCONFIG_HISTORY_SIZE 16
+#define WALLPAPER_NAMESPACE "mobi.phosh.wallpaper"
+
 static GHashTable *settings_hash;
 static FcMonitor *fontconfig_monitor;
 static int fontconfig_serial;
+static GQueue fontconfig_history = G_QUEUE_INIT;
+static guint fontconfig_users;
 static gboolean enable_animations;
+static GSettings *background_settings;
+static char *wallpaper_blurred_uri;
+static GVariant *wallpaper_palette;
 
 static void sync_animations_enabled (PmpImplSettings *impl);
 
@@ -36,6 +47,21 @@ typedef struct {
   GSettings       *settings;
 } SettingsBundle;
 
+/* The families that changed with a fontconfig serial */
+typedef struct {
+  int    serial;
+  GStrv  added;
+  GStrv  removed;
+} FontconfigChange;
+
+static void
+fontconfig_change_free (FontconfigChange *change)
+{
+  g_strfreev (change->added);
+  g_strfreev (change->removed);
+  g_free (change);
+}
+
 static SettingsBundle *
 settings_bundle_new (GSettingsSchema *schema, GSettings *settings)
 {
@@ -178,6 +204,125 @@ get_theme_value (const char *key)
   return g_variant_new_string (theme);
 }
 
+static GVariant *
+get_fontconfig_families (gboolean added)
+{
+  FontconfigChange *change = g_queue_peek_head (&fontconfig_history);
+  const char * const *families = NULL;
+
+  if (change)
+    families = (const char * const *)(added ? change->added : change->removed);
+
+  return g_variant_new_strv (families, families ? -1 : 0);
+}
+
+/*
+ * The most recent changes, newest first. A client that last saw a
+ * serial older than the last entry missed changes and needs to do a
+ * full reload.
+ */
+static GVariant *
+get_fontconfig_history (void)
+{
+  GVariantBuilder builder;
+  GList *l;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(iasas)"));
+  for (l = fontconfig_history.head; l; l = l->next) {
+    FontconfigChange *change = l->data;
+
+    g_variant_builder_add (&builder, "(i^as^as)", change->serial, change->added, change->removed);
+  }
+
+  return g_variant_builder_end (&builder);
+}
+
+static GVariant *
+get_fontconfig_value (const char *key)
+{
+  if (strcmp (key, "serial") == 0)
+    return g_variant_new_int32 (fontconfig_serial);
+  else if (strcmp (key, "added-families") == 0)
+    return get_fontconfig_families (TRUE);
+  else if (strcmp (key, "removed-families") == 0)
+    return get_fontconfig_families (FALSE);
+  else if (strcmp (key, "history") == 0)
+    return get_fontconfig_history ();
+
+  return NULL;
+}
+
+static const char * const fontconfig_keys[] = {
+  "serial",
+  "added-families",
+  "removed-families",
+  "history",
+};
+
+/* A variant of the current wallpaper if it's in our store */
+static char *
+lookup_wallpaper_variant (const char *variant, const char *extension)
+{
+  g_autofree char *uri = g_settings_get_string (background_settings, "picture-uri");
+  g_autofree char *path = g_filename_from_uri (uri, NULL, NULL);
+
+  if (!path)
+    return NULL;
+
+  return pmp_wallpaper_store_find_variant (path, variant, extension);
+}
+
+static char *
+lookup_wallpaper_blurred_uri (void)
+{
+  g_autofree char *blurred = lookup_wallpaper_variant ("blurred", NULL);
+
+  if (!blurred)
+    return NULL;
+
+  return g_filename_to_uri (blurred, NULL, NULL);
+}
+
+/* The dominant colors of the current wallpaper, most dominant first */
+static GVariant *
+lookup_wallpaper_palette (void)
+{
+  g_autofree char *path = lookup_wallpaper_variant ("palette", "ini");
+  g_autoptr (GArray) palette = NULL;
+  g_autoptr (GError) err = NULL;
+  GVariantBuilder builder;
+  guint i;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(ddd)"));
+
+  if (path) {
+    palette = pmp_palette_load (path, &err);
+    if (!palette)
+      g_warning ("Failed to load palette %s: %s", path, err->message);
+  }
+
+  for (i = 0; palette && i < palette->len; i++) {
+    PmpPaletteColor *color = &g_array_index (palette, PmpPaletteColor, i);
+
+    g_variant_builder_add (&builder, "(ddd)", color->red, color->green, color->blue);
+  }
+
+  return g_variant_ref_sink (g_variant_builder_end (&builder));
+}
+
+static GVariant *
+get_wallpaper_value (const char *key)
+{
+  if (strcmp (key, "blurred-uri") == 0)
+    return g_variant_new_string (wallpaper_blurred_uri ?: "");
+
+  return NULL;
+}
+
+static const char * const wallpaper_keys[] = {
+  "blurred-uri",
+};
+
 static gboolean
 settings_handle_read_all (PmpImplSettings       *object,
                           GDBusMethodInvocation *invocation,
@@ -218,13 +363,26 @@ settings_handle_read_all (PmpImplSettings       *object,
 
   if (namespace_matches ("org.gnome.fontconfig", arg_namespaces)) {
     GVariantDict dict;
+    gsize i;
 
     g_variant_dict_init (&dict, NULL);
-    g_variant_dict_insert_value (&dict, "serial", g_variant_new_int32 (fontconfig_serial));
+    for (i = 0; i < G_N_ELEMENTS (fontconfig_keys); i++)
+      g_variant_dict_insert_value (&dict, fontconfig_keys[i], get_fontconfig_value (fontconfig_keys[i]));
 
     g_variant_builder_add (builder, "{s@a{sv}}", "org.gnome.fontconfig", g_variant_dict_end (&dict));
   }
 
+  if (namespace_matches (WALLPAPER_NAMESPACE, arg_namespaces)) {
+    GVariantDict dict;
+    gsize i;
+
+    g_variant_dict_init (&dict, NULL);
+    for (i = 0; i < G_N_ELEMENTS (wallpaper_keys); i++)
+      g_variant_dict_insert_value (&dict, wallpaper_keys[i], get_wallpaper_value (wallpaper_keys[i]));
+
+    g_variant_builder_add (builder, "{s@a{sv}}", WALLPAPER_NAMESPACE, g_variant_dict_end (&dict));
+  }
+
   if (namespace_matches ("org.freedesktop.appearance", arg_namespaces)) {
     GVariantDict dict;
 
@@ -232,6 +390,7 @@ settings_handle_read_all (PmpImplSettings       *object,
     g_variant_dict_insert_value (&dict, "accent-color", get_accent_color ());
     g_variant_dict_insert_value (&dict, "color-scheme", get_color_scheme ());
     g_variant_dict_insert_value (&dict, "contrast", get_contrast_value ());
+    g_variant_dict_insert_value (&dict, "wallpaper-palette", wallpaper_palette);
 
     g_variant_builder_add (builder, "{s@a{sv}}", "org.freedesktop.appearance", g_variant_dict_end (&dict));
   }
@@ -253,9 +412,17 @@ settings_handle_read (PmpImplSettings       *object,
   g_debug ("Read %s %s", arg_namespace, arg_key);
 
   if (strcmp (arg_namespace, "org.gnome.fontconfig") == 0) {
-    if (strcmp (arg_key, "serial") == 0) {
-      g_dbus_method_invocation_return_value (invocation,
-                                             g_variant_new ("(v)", g_variant_new_int32 (fontconfig_serial)));
+    GVariant *value = get_fontconfig_value (arg_key);
+
+    if (value) {
+      g_dbus_method_invocation_return_value (invocation, g_variant_new ("(v)", value));
+      return TRUE;
+    }
+  } else if (strcmp (arg_namespace, WALLPAPER_NAMESPACE) == 0) {
+    GVariant *value = get_wallpaper_value (arg_key);
+
+    if (value) {
+      g_dbus_method_invocation_return_value (invocation, g_variant_new ("(v)", value));
       return TRUE;
     }
   } else if (strcmp (arg_namespace, "org.freedesktop.appearance") == 0) {
@@ -271,6 +438,10 @@ settings_handle_read (PmpImplSettings       *object,
       g_dbus_method_invocation_return_value (invocation,
                                              g_variant_new ("(v)", get_accent_color ()));
       return TRUE;
+    } else if (strcmp (arg_key, "wallpaper-palette") == 0) {
+      g_dbus_method_invocation_return_value (invocation,
+                                             g_variant_new ("(v)", wallpaper_palette));
+      return TRUE;
     }
   } else if (strcmp (arg_namespace, "org.gnome.desktop.interface") == 0 &&
             strcmp (arg_key, "enable-animations") == 0) {
@@ -413,15 +584,60 @@ fontconfig_changed (FcMonitor       *monitor,
                     PmpImplSettings *impl)
 {
   const char *namespace = "org.gnome.fontconfig";
-  const char *key = "serial";
-
-  g_debug ("Emitting changed for %s %s", namespace, key);
+  FontconfigChange *change;
+  gsize i;
 
   fontconfig_serial++;
 
-  pmp_impl_settings_emit_setting_changed (impl,
-                                          namespace, key,
-                                          g_variant_new ("v", g_variant_new_int32 (fontconfig_serial)));
+  change = g_new0 (FontconfigChange, 1);
+  change->serial = fontconfig_serial;
+  change->added = g_strdupv ((GStrv)fc_monitor_get_added_families (monitor));
+  change->removed = g_strdupv ((GStrv)fc_monitor_get_removed_families (monitor));
+  g_queue_push_head (&fontconfig_history, change);
+  while (g_queue_get_length (&fontconfig_history) > FONTCONFIG_HISTORY_SIZE)
+    fontconfig_change_free (g_queue_pop_tail (&fontconfig_history));
+
+  g_debug ("Fontconfig serial %d: %u families added, %u removed", fontconfig_serial,
+           g_strv_length (change->added), g_strv_length (change->removed));
+
+  /* Emit serial last so clients reacting on it see consistent details */
+  for (i = G_N_ELEMENTS (fontconfig_keys); i > 0; i--) {
+    const char *key = fontconfig_keys[i - 1];
+
+    g_debug ("Emitting changed for %s %s", namespace, key);
+    pmp_impl_settings_emit_setting_changed (impl,
+                                            namespace, key,
+                                            g_variant_new ("v", get_fontconfig_value (key)));
+  }
+}
+
+static void
+on_background_changed (GSettings       *settings,
+                       const char      *key,
+                       PmpImplSettings *impl)
+{
+  g_autofree char *blurred_uri = lookup_wallpaper_blurred_uri ();
+  g_autoptr (GVariant) palette = lookup_wallpaper_palette ();
+
+  if (g_strcmp0 (blurred_uri, wallpaper_blurred_uri) != 0) {
+    g_free (wallpaper_blurred_uri);
+    wallpaper_blurred_uri = g_steal_pointer (&blurred_uri);
+
+    g_debug ("Emitting changed for %s %s", WALLPAPER_NAMESPACE, "blurred-uri");
+    pmp_impl_settings_emit_setting_changed (impl,
+                                            WALLPAPER_NAMESPACE, "blurred-uri",
+                                            g_variant_new ("v", get_wallpaper_value ("blurred-uri")));
+  }
+
+  if (!g_variant_equal (palette, wallpaper_palette)) {
+    g_variant_unref (wallpaper_palette);
+    wallpaper_palette = g_steal_pointer (&palette);
+
+    g_debug ("Emitting changed for org.freedesktop.appearance wallpaper-palette");
+    pmp_impl_settings_emit_setting_changed (impl,
+                                            "org.freedesktop.appearance", "wallpaper-palette",
+                                            g_variant_new ("v", wallpaper_palette));
+  }
 }
 
 static void
@@ -457,6 +673,43 @@ sync_animations_enabled (PmpImplSettings *impl)
 }
 
 
+/**
+ * pmp_settings_hold_fonts:
+ *
+ * Call before showing UI so font changes get picked up by the process.
+ * Until then font changes are only detected without loading any fonts.
+ */
+void
+pmp_settings_hold_fonts (void)
+{
+  if (fontconfig_users++ > 0)
+    return;
+
+  if (fontconfig_monitor)
+    fc_monitor_set_load_fonts (fontconfig_monitor, TRUE);
+}
+
+/**
+ * pmp_settings_release_fonts:
+ *
+ * Call once the UI is gone. When the last user releases the fonts the
+ * loaded font set is dropped.
+ */
+void
+pmp_settings_release_fonts (void)
+{
+  g_return_if_fail (fontconfig_users > 0);
+
+  if (--fontconfig_users > 0)
+    return;
+
+  /* Let GTK create a new font map on next use so the old one can go away */
+  pango_cairo_font_map_set_default (NULL);
+
+  if (fontconfig_monitor)
+    fc_monitor_set_load_fonts (fontconfig_monitor, FALSE);
+}
+
 gboolean
 pmp_settings_init (GDBusConnection *bus, GError **error)
 {
@@ -477,6 +730,13 @@ pmp_settings_init (GDBusConnection *bus, GError **error)
 
   sync_animations_enabled (PMP_IMPL_SETTINGS (helper));
 
+  /* Wallpaper details are derived from the wallpaper store */
+  background_settings = g_settings_new ("org.gnome.desktop.background");
+  g_signal_connect (background_settings, "changed::picture-uri",
+                    G_CALLBACK (on_background_changed), helper);
+  wallpaper_blurred_uri = lookup_wallpaper_blurred_uri ();
+  wallpaper_palette = lookup_wallpaper_palette ();
+
   if (!g_dbus_interface_skeleton_export (helper,
                                          bus,
                                          DESKTOP_PORTAL_OBJECT_PATH,
@@ -14,5 +14,7 @@
 G_BEGIN_DECLS
 
 gboolean pmp_settings_init (GDBusConnection *bus, GError **error);
+void     pmp_settings_hold_fonts (void);
+void     pmp_settings_release_fonts (void);
 
 G_END_DECLS
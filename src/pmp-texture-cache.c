@@ -0,0 +1,181 @@
+/*
+ * Copyright © 2024 The Phosh Developers
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "pmp-config.h"
+
+#include "pmp-texture-cache.h"
+
+/* Enough for a couple of previews at full screen size */
+#define TEXTURE_CACHE_MAX_BYTES (32 * 1024 * 1024)
+/* Upper bound of the memory a texture needs per pixel */
+#define TEXTURE_CACHE_BYTES_PER_PIXEL 4
+
+typedef struct {
+  char       *key;
+  GdkTexture *texture;
+  gsize       size;
+  GList      *link;
+} CacheEntry;
+
+/* Used from the I/O pool's threads and the main thread */
+static GMutex cache_lock;
+/* Keys to entries */
+static GHashTable *entries;
+/* Most recently used first */
+static GQueue lru = G_QUEUE_INIT;
+static gsize cache_size;
+static guint cache_users;
+static guint hits;
+static guint misses;
+
+static gboolean
+drop_texture (gpointer data)
+{
+  return G_SOURCE_REMOVE;
+}
+
+static void
+cache_entry_free (CacheEntry *entry)
+{
+  g_free (entry->key);
+
+  /* The renderer might have attached data to the texture that must go away on the main thread */
+  if (g_main_context_is_owner (g_main_context_default ())) {
+    g_clear_object (&entry->texture);
+  } else {
+    g_main_context_invoke_full (NULL, G_PRIORITY_LOW, drop_texture,
+                                g_steal_pointer (&entry->texture), g_object_unref);
+  }
+
+  g_free (entry);
+}
+
+static void
+remove_entry (CacheEntry *entry)
+{
+  g_queue_delete_link (&lru, entry->link);
+  cache_size -= entry->size;
+  /* Frees the entry */
+  g_hash_table_remove (entries, entry->key);
+}
+
+static void
+ensure_entries (void)
+{
+  if (entries)
+    return;
+
+  entries = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                   (GDestroyNotify) cache_entry_free);
+}
+
+/**
+ * pmp_texture_cache_lookup:
+ * @key: The key identifying the image, its modification time and size
+ *
+ * Looks up a decoded and scaled texture. Can be called from any thread.
+ *
+ * Returns: (transfer full) (nullable): The cached texture
+ */
+GdkTexture *
+pmp_texture_cache_lookup (const char *key)
+{
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&cache_lock);
+  CacheEntry *entry = NULL;
+
+  if (entries)
+    entry = g_hash_table_lookup (entries, key);
+
+  if (!entry) {
+    misses++;
+    return NULL;
+  }
+
+  hits++;
+  g_queue_unlink (&lru, entry->link);
+  g_queue_push_head_link (&lru, entry->link);
+
+  return g_object_ref (entry->texture);
+}
+
+/**
+ * pmp_texture_cache_insert:
+ * @key: The key identifying the image, its modification time and size
+ * @texture: The texture
+ *
+ * Adds @texture to the cache, evicting the least recently used
+ * textures when over budget. Can be called from any thread.
+ */
+void
+pmp_texture_cache_insert (const char *key, GdkTexture *texture)
+{
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&cache_lock);
+  CacheEntry *entry;
+  gsize size;
+
+  g_return_if_fail (GDK_IS_TEXTURE (texture));
+
+  size = (gsize) gdk_texture_get_width (texture) * gdk_texture_get_height (texture) *
+    TEXTURE_CACHE_BYTES_PER_PIXEL;
+
+  /* Nobody would benefit */
+  if (!cache_users || size > TEXTURE_CACHE_MAX_BYTES)
+    return;
+
+  ensure_entries ();
+  entry = g_hash_table_lookup (entries, key);
+  if (entry)
+    remove_entry (entry);
+
+  while (cache_size + size > TEXTURE_CACHE_MAX_BYTES)
+    remove_entry (g_queue_peek_tail (&lru));
+
+  entry = g_new0 (CacheEntry, 1);
+  entry->key = g_strdup (key);
+  entry->texture = g_object_ref (texture);
+  entry->size = size;
+  g_queue_push_head (&lru, entry);
+  entry->link = lru.head;
+  cache_size += size;
+  g_hash_table_insert (entries, entry->key, entry);
+}
+
+/**
+ * pmp_texture_cache_hold:
+ *
+ * Call when showing UI that uses the cache.
+ */
+void
+pmp_texture_cache_hold (void)
+{
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&cache_lock);
+
+  cache_users++;
+}
+
+/**
+ * pmp_texture_cache_release:
+ *
+ * Call once the UI is gone. When the last user releases the cache all
+ * textures are dropped.
+ */
+void
+pmp_texture_cache_release (void)
+{
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&cache_lock);
+
+  g_return_if_fail (cache_users > 0);
+
+  if (--cache_users > 0)
+    return;
+
+  g_debug ("Dropping %u cached textures (%" G_GSIZE_FORMAT " KiB), %u hits, %u misses",
+           lru.length, cache_size / 1024, hits, misses);
+
+  g_queue_clear (&lru);
+  g_clear_pointer (&entries, g_hash_table_destroy);
+  cache_size = 0;
+}
@@ -0,0 +1,19 @@
+/*
+ * Copyright © 2024 The Phosh Developers
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <gdk/gdk.h>
+
+G_BEGIN_DECLS
+
+GdkTexture *pmp_texture_cache_lookup  (const char *key);
+void        pmp_texture_cache_insert  (const char *key,
+                                       GdkTexture *texture);
+void        pmp_texture_cache_hold    (void);
+void        pmp_texture_cache_release (void);
+
+G_END_DECLS
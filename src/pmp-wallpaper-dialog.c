@@ -34,8 +34,6 @@ struct _PmpWallpaperDialog {
 
   GtkWidget           *stack;
   PmpWallpaperPreview *desktop_preview;
-
-  gchar               *picture_uri;
 };
 
 G_DEFINE_TYPE (PmpWallpaperDialog, pmp_wallpaper_dialog, ADW_TYPE_WINDOW)
@@ -52,16 +50,6 @@ pmp_wallpaper_dialog_cancel (PmpWallpaperDialog *self)
   g_signal_emit (self, signals[RESPONSE], 0, GTK_RESPONSE_CANCEL);
 }
 
-static void
-pmp_wallpaper_dialog_finalize (GObject *object)
-{
-  PmpWallpaperDialog *self = PMP_WALLPAPER_DIALOG (object);
-
-  g_clear_pointer (&self->picture_uri, g_free);
-
-  G_OBJECT_CLASS (pmp_wallpaper_dialog_parent_class)->finalize (object);
-}
-
 static void
 pmp_wallpaper_dialog_init (PmpWallpaperDialog *self)
 {
@@ -71,11 +59,8 @@ pmp_wallpaper_dialog_init (PmpWallpaperDialog *self)
 static void
 pmp_wallpaper_dialog_class_init (PmpWallpaperDialogClass *klass)
 {
-  GObjectClass *object_class = G_OBJECT_CLASS (klass);
   GtkWidgetClass *widget_class = GTK_WIDGET_CLASS (klass);
 
-  object_class->finalize = pmp_wallpaper_dialog_finalize;
-
   signals[RESPONSE] = g_signal_new ("response",
                                     G_TYPE_FROM_CLASS (klass),
                                     G_SIGNAL_ACTION | G_SIGNAL_RUN_LAST,
@@ -95,55 +80,26 @@ pmp_wallpaper_dialog_class_init (PmpWallpaperDialogClass *klass)
   gtk_widget_class_bind_template_callback (widget_class, pmp_wallpaper_dialog_apply);
 }
 
-static void
-on_image_loaded_cb (GObject      *source_object,
-                    GAsyncResult *result,
-                    gpointer      data)
-{
-  PmpWallpaperDialog *self = data;
-  GFileIOStream *stream = NULL;
-  GFile *image_file = G_FILE (source_object);
-  g_autoptr (GFile) tmp = g_file_new_tmp ("XXXXXX", &stream, NULL);
-  g_autoptr (GError) error = NULL;
-  gchar *contents = NULL;
-  gsize length = 0;
-
-  g_object_unref (stream);
-
-  if (!g_file_load_contents_finish (image_file, result, &contents, &length, NULL, &error)) {
-    g_warning ("Failed to load image: %s", error->message);
-
-    return;
-  }
-
-  if (!g_file_replace_contents (tmp, contents, length, NULL, FALSE,
-                                G_FILE_CREATE_REPLACE_DESTINATION, NULL, NULL, &error)) {
-    g_warning ("Failed to store image: %s", error->message);
-    return;
-  }
-
-  self->picture_uri = g_file_get_uri (tmp);
-  pmp_wallpaper_preview_set_image (self->desktop_preview, self->picture_uri);
-}
-
 PmpWallpaperDialog *
-pmp_wallpaper_dialog_new (const gchar *picture_uri, const gchar *app_id)
+pmp_wallpaper_dialog_new (void)
 {
-  PmpWallpaperDialog *self;
-  g_autoptr (GFile) image_file = g_file_new_for_uri (picture_uri);
-
-  self = g_object_new (PMP_WALLPAPER_TYPE_DIALOG, NULL);
-
-  g_file_load_contents_async (image_file,
-                              NULL,
-                              on_image_loaded_cb,
-                              self);
-
-  return self;
+  return g_object_new (PMP_WALLPAPER_TYPE_DIALOG, NULL);
 }
 
-const gchar *
-pmp_wallpaper_dialog_get_uri (PmpWallpaperDialog *dialog)
+/**
+ * pmp_wallpaper_dialog_set_image:
+ * @self: The wallpaper dialog
+ * @picture_uri: The image to preview
+ *
+ * Sets the image to preview. This allows to create the dialog ahead of
+ * time.
+ */
+void
+pmp_wallpaper_dialog_set_image (PmpWallpaperDialog *self, const char *picture_uri)
 {
-  return dialog->picture_uri;
+  g_return_if_fail (PMP_IS_WALLPAPER_DIALOG (self));
+
+  /* The preview streams the image itself, the portal stages the one
+   * copy we keep in the wallpaper store */
+  pmp_wallpaper_preview_set_image (self->desktop_preview, picture_uri);
 }
@@ -21,7 +21,8 @@ G_BEGIN_DECLS
 
 G_DECLARE_FINAL_TYPE (PmpWallpaperDialog, pmp_wallpaper_dialog, PMP, WALLPAPER_DIALOG, AdwWindow);
 
-PmpWallpaperDialog *pmp_wallpaper_dialog_new (const char *picture_uri, const char *app_id);
-const gchar        *pmp_wallpaper_dialog_get_uri (PmpWallpaperDialog *dialog);
+PmpWallpaperDialog *pmp_wallpaper_dialog_new       (void);
+void                pmp_wallpaper_dialog_set_image (PmpWallpaperDialog *self,
+                                                    const char         *picture_uri);
 
 G_END_DECLS
@@ -13,6 +13,7 @@
 
 #include "pmp-config.h"
 
+#include <math.h>
 #include <string.h>
 
 #include <gdk-pixbuf/gdk-pixbuf.h>
@@ -23,7 +24,94 @@
 #define GNOME_DESKTOP_USE_UNSTABLE_API
 #include <gnome-bg/gnome-bg.h>
 
+#include "pmp-io-pool.h"
+#include "pmp-texture-cache.h"
 #include "pmp-wallpaper-preview.h"
+#include "pmp-wallpaper-variants.h"
+
+/* Thumbnails are rendered in steps of that many physical pixels so resizes don't re-render */
+#define PREVIEW_BUCKET_SIZE 256
+/* Persistent freedesktop thumbnails, at most PREVIEW_THUMBNAIL_MAX pixels per side */
+#define PREVIEW_THUMBNAIL_SIZE GNOME_DESKTOP_THUMBNAIL_SIZE_XXLARGE
+#define PREVIEW_THUMBNAIL_MAX  1024
+/* Size of the coarse first paint, small enough for the decoder's fastest scaling */
+#define PREVIEW_QUICK_SIZE     128
+/* The chunks fed to the loader */
+#define PREVIEW_CHUNK_SIZE     (64 * 1024)
+/* Upper bound of the decoded size per pixel */
+#define PREVIEW_BYTES_PER_PIXEL 4
+
+typedef struct {
+  char                         *uri;
+  GnomeDesktopThumbnailFactory *factory;
+  /* The size buckets, one per monitor */
+  GArray                       *outputs;
+  /* Paint a coarse version first if the full one needs decoding */
+  gboolean                      quick;
+  /* Only used on the main thread while the task isn't cancelled */
+  PmpWallpaperPreview          *preview;
+  GCancellable                 *cancellable;
+} RenderData;
+
+typedef struct {
+  GTask      *task;
+  GdkTexture *texture;
+} QuickPaint;
+
+typedef struct {
+  int      size;
+  gsize    reserved;
+  /* Decoded smaller than asked for to stay within the budget */
+  gboolean degraded;
+  /* Not even the coarsest decode fits into the budget */
+  gboolean over_budget;
+} DecodeData;
+
+typedef struct {
+  /* Shared between all outputs */
+  GdkPixbuf  *source;
+  int         width;
+  int         height;
+  char       *key;
+  GdkTexture *texture;
+} OutputJob;
+
+/* Memory all previews may use for decoding at once, shared by the I/O pool's threads */
+static GMutex budget_lock;
+static gsize budget_max = 64 * 1024 * 1024;
+static gsize budget_in_use;
+static gsize budget_peak;
+
+/* Reserves up to @wanted bytes but at least @minimum, returns the granted amount or 0 if that doesn't fit */
+static gsize
+budget_reserve (gsize wanted, gsize minimum)
+{
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&budget_lock);
+  gsize available = budget_max > budget_in_use ? budget_max - budget_in_use : 0;
+  gsize granted = available >= minimum ? MIN (wanted, available) : 0;
+
+  budget_in_use += granted;
+  budget_peak = MAX (budget_peak, budget_in_use);
+
+  return granted;
+}
+
+static void
+budget_release (gsize bytes)
+{
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&budget_lock);
+
+  g_assert (budget_in_use >= bytes);
+  budget_in_use -= bytes;
+}
+
+static gsize
+budget_get_peak (void)
+{
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&budget_lock);
+
+  return budget_peak;
+}
 
 struct _PmpWallpaperPreview {
   GtkBox                        parent;
@@ -32,11 +120,23 @@ struct _PmpWallpaperPreview {
   GtkWidget                    *desktop_preview;
   GtkWidget                    *animated_background_icon;
   GtkLabel                     *desktop_clock_label;
-  GtkWidget                    *drawing_area;
+  GtkStack                     *monitor_stack;
+  /* One picture per monitor, owned by the monitor stack */
+  GPtrArray                    *pictures;
 
   GnomeDesktopThumbnailFactory *thumbnail_factory;
   GnomeBG                      *bg;
 
+  /* The rendered thumbnail is cached, drawing it doesn't depend on the image size */
+  char                         *uri;
+  char                         *path;
+  GArray                       *buckets;
+  guint                         render_id;
+  GCancellable                 *cancellable;
+  gint64                        start_time;
+  gboolean                      have_quick;
+  gboolean                      have_final;
+
   GSettings                    *desktop_settings;
   gboolean                      is_24h_format;
   GDateTime                    *previous_time;
@@ -46,31 +146,828 @@ struct _PmpWallpaperPreview {
 G_DEFINE_FINAL_TYPE (PmpWallpaperPreview, pmp_wallpaper_preview, GTK_TYPE_BOX)
 
 static void
-draw_preview_func (GtkDrawingArea *drawing_area,
-                   cairo_t        *cr,
-                   int             width,
-                   int             height,
-                   gpointer        data)
+render_data_free (RenderData *data)
 {
-  PmpWallpaperPreview *self = PMP_WALLPAPER_PREVIEW (data);
-  g_autoptr (GdkMonitor) monitor = NULL;
+  g_free (data->uri);
+  g_clear_object (&data->factory);
+  g_clear_pointer (&data->outputs, g_array_unref);
+  g_clear_object (&data->cancellable);
+  g_free (data);
+}
+
+/* Looks up the image in the freedesktop thumbnail cache */
+static GdkPixbuf *
+lookup_thumbnail (RenderData *data, GFileInfo *info)
+{
+  g_autoptr (GError) error = NULL;
+  g_autofree char *thumbnail_path = NULL;
+  GdkPixbuf *pixbuf;
+  time_t mtime;
+
+  mtime = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED);
+  thumbnail_path = gnome_desktop_thumbnail_factory_lookup (data->factory, data->uri, mtime);
+  if (!thumbnail_path)
+    return NULL;
+
+  pixbuf = gdk_pixbuf_new_from_file (thumbnail_path, &error);
+  if (!pixbuf)
+    g_debug ("Failed to load thumbnail %s: %s", thumbnail_path, error->message);
+
+  return pixbuf;
+}
+
+/* Creates the cached thumbnail so opening the preview again is fast */
+static GdkPixbuf *
+create_thumbnail (RenderData *data, GFileInfo *info, GCancellable *cancellable)
+{
+  g_autoptr (GError) error = NULL;
+  GdkPixbuf *pixbuf;
+  const char *content_type;
+  time_t mtime;
+
+  mtime = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED);
+  content_type = g_file_info_get_content_type (info);
+  if (!gnome_desktop_thumbnail_factory_can_thumbnail (data->factory, data->uri, content_type, mtime))
+    return NULL;
+
+  pixbuf = gnome_desktop_thumbnail_factory_generate_thumbnail (data->factory,
+                                                               data->uri,
+                                                               content_type,
+                                                               cancellable,
+                                                               &error);
+  if (!pixbuf) {
+    g_debug ("Failed to create thumbnail for %s: %s", data->uri, error->message);
+    if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+      gnome_desktop_thumbnail_factory_create_failed_thumbnail (data->factory, data->uri, mtime,
+                                                               cancellable, NULL);
+    return NULL;
+  }
+
+  if (!gnome_desktop_thumbnail_factory_save_thumbnail (data->factory, pixbuf, data->uri, mtime,
+                                                       cancellable, &error))
+    g_debug ("Failed to save thumbnail for %s: %s", data->uri, error->message);
+
+  return pixbuf;
+}
+
+/* The image's format and size from its header, %NULL if unknown e.g. for remote files */
+static GdkPixbufFormat *
+probe_image (GFile *file, int *width, int *height)
+{
+  g_autofree char *path = g_file_get_path (file);
+
+  if (!path)
+    return NULL;
+
+  return gdk_pixbuf_get_file_info (path, width, height);
+}
+
+/* Whether the loader decodes at a fraction of the size, otherwise it decodes everything */
+static gboolean
+can_scale_on_decode (GdkPixbufFormat *format)
+{
+  g_autofree char *name = format ? gdk_pixbuf_format_get_name (format) : NULL;
+
+  return g_strcmp0 (name, "jpeg") == 0;
+}
+
+/*
+ * The memory the loader needs to decode a @width x @height image at
+ * @scale. Only JPEG scales while decoding, in DCT steps of 1/2, 1/4 and
+ * 1/8 using the smallest one that is still larger than the target.
+ * Other loaders decode at full size. Either way the loader scales the
+ * decoded image to the target size afterwards.
+ */
+static gsize
+get_decode_bytes (GdkPixbufLoader *loader, int width, int height, double scale)
+{
+  double target_width = width * scale;
+  double target_height = height * scale;
+  double decoded;
+  int denom;
+
+  if (scale >= 1.0)
+    return (gsize) width * height * PREVIEW_BYTES_PER_PIXEL;
+
+  if (can_scale_on_decode (gdk_pixbuf_loader_get_format (loader))) {
+    for (denom = 8; denom > 1; denom /= 2) {
+      if (ceil ((double) width / denom) >= target_width &&
+          ceil ((double) height / denom) >= target_height)
+        break;
+    }
+    decoded = ceil ((double) width / denom) * ceil ((double) height / denom);
+  } else {
+    decoded = (double) width * height;
+  }
+
+  return (gsize) ((decoded + target_width * target_height) * PREVIEW_BYTES_PER_PIXEL);
+}
+
+static void
+on_size_prepared (GdkPixbufLoader *loader, int width, int height, DecodeData *data)
+{
+  double scale, minimum_scale;
+  gsize bytes;
+
+  /* Cover a square of the larger side so the thumbnail covers every
+   * bucket even if the embedded orientation swaps width and height. Each
+   * monitor's preview is cropped from it afterwards. */
+  scale = MIN (1.0, (double) data->size / MIN (width, height));
+  minimum_scale = MIN (scale, (double) PREVIEW_QUICK_SIZE / MIN (width, height));
+  bytes = get_decode_bytes (loader, width, height, scale);
+
+  /* Rather go coarser than exceed the budget. Loaders that can't scale
+   * need the full size no matter what, don't decode at all if even the
+   * coarsest version doesn't fit. A zero size makes the loader bail out
+   * before allocating. */
+  data->reserved = budget_reserve (bytes, get_decode_bytes (loader, width, height, minimum_scale));
+  if (!data->reserved) {
+    data->over_budget = TRUE;
+    gdk_pixbuf_loader_set_size (loader, 0, 0);
+    return;
+  }
+
+  if (data->reserved < bytes) {
+    g_debug ("Preview decode over budget, using %" G_GSIZE_FORMAT " of %" G_GSIZE_FORMAT " bytes",
+             data->reserved, bytes);
+    while (scale > minimum_scale && get_decode_bytes (loader, width, height, scale) > data->reserved) {
+      scale = MAX (minimum_scale, scale * 0.9);
+      data->degraded = TRUE;
+    }
+
+    /* Hand back what the coarser decode doesn't need */
+    bytes = get_decode_bytes (loader, width, height, scale);
+    if (bytes < data->reserved) {
+      budget_release (data->reserved - bytes);
+      data->reserved = bytes;
+    }
+  }
+
+  if (scale < 1.0) {
+    gdk_pixbuf_loader_set_size (loader,
+                                MAX (1, (int) (width * scale)),
+                                MAX (1, (int) (height * scale)));
+  }
+}
+
+static gboolean
+feed_loader (GdkPixbufLoader *loader,
+             GInputStream    *stream,
+             GCancellable    *cancellable,
+             GError         **error)
+{
+  g_autofree guchar *buffer = g_malloc (PREVIEW_CHUNK_SIZE);
+  gssize n_read;
+
+  while ((n_read = g_input_stream_read (stream, buffer, PREVIEW_CHUNK_SIZE, cancellable, error)) > 0) {
+    if (!gdk_pixbuf_loader_write (loader, buffer, n_read, error)) {
+      gdk_pixbuf_loader_close (loader, NULL);
+      return FALSE;
+    }
+  }
+
+  if (n_read < 0) {
+    gdk_pixbuf_loader_close (loader, NULL);
+    return FALSE;
+  }
+
+  return gdk_pixbuf_loader_close (loader, error);
+}
+
+/*
+ * Streams the image through a loader so the decode keeps up with the
+ * reads, can be cancelled between chunks and works for any GFile. The
+ * memory reserved for it is returned in @decode, release it once done
+ * with the result. Fails with %G_IO_ERROR_NO_SPACE if the image can't
+ * be decoded within the budget.
+ */
+static GdkPixbuf *
+decode_image (RenderData   *data,
+              GFile        *file,
+              DecodeData   *decode,
+              GCancellable *cancellable,
+              GError      **error)
+{
+  g_autoptr (GFileInputStream) stream = NULL;
+  g_autoptr (GdkPixbufLoader) loader = NULL;
+  g_autoptr (GError) local_error = NULL;
+  GdkPixbuf *pixbuf = NULL;
+
+  decode->reserved = 0;
+  decode->degraded = FALSE;
+  decode->over_budget = FALSE;
+
+  stream = g_file_read (file, cancellable, error);
+  if (!stream)
+    return NULL;
+
+  loader = gdk_pixbuf_loader_new ();
+  g_signal_connect (loader, "size-prepared", G_CALLBACK (on_size_prepared), decode);
+
+  if (!feed_loader (loader, G_INPUT_STREAM (stream), cancellable, &local_error)) {
+    /* The loader's error about the zero size isn't helpful */
+    if (decode->over_budget) {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NO_SPACE,
+                   "Decoding %s exceeds the preview memory budget", data->uri);
+    } else {
+      g_propagate_error (error, g_steal_pointer (&local_error));
+    }
+    return NULL;
+  }
+
+  pixbuf = gdk_pixbuf_loader_get_pixbuf (loader);
+  if (pixbuf)
+    pixbuf = gdk_pixbuf_apply_embedded_orientation (pixbuf);
+  else
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Failed to decode %s", data->uri);
+
+  return pixbuf;
+}
+
+static void set_textures (PmpWallpaperPreview *self, GPtrArray *textures, gboolean final);
+
+static gboolean
+on_quick_paint (gpointer user_data)
+{
+  QuickPaint *quick = user_data;
+  RenderData *data = g_task_get_task_data (quick->task);
+  g_autoptr (GPtrArray) textures = g_ptr_array_new ();
+
+  /* The preview might be gone already */
+  if (g_cancellable_is_cancelled (data->cancellable))
+    return G_SOURCE_REMOVE;
+
+  g_ptr_array_add (textures, quick->texture);
+  set_textures (data->preview, textures, FALSE);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+quick_paint_free (QuickPaint *quick)
+{
+  g_clear_object (&quick->task);
+  g_clear_object (&quick->texture);
+  g_free (quick);
+}
+
+/* Decodes a coarse version via the DCT scaling to show while the full one renders */
+static void
+render_quick (GTask *task, RenderData *data, GFile *file)
+{
+  g_autoptr (GdkPixbuf) pixbuf = NULL;
+  DecodeData decode = { .size = PREVIEW_QUICK_SIZE };
+  QuickPaint *quick;
+
+  pixbuf = decode_image (data, file, &decode, data->cancellable, NULL);
+  if (!pixbuf) {
+    budget_release (decode.reserved);
+    return;
+  }
+
+  quick = g_new0 (QuickPaint, 1);
+  quick->task = g_object_ref (task);
+  quick->texture = gdk_texture_new_for_pixbuf (pixbuf);
+  g_clear_object (&pixbuf);
+  budget_release (decode.reserved);
+  g_main_context_invoke_full (g_task_get_context (task),
+                              G_PRIORITY_DEFAULT,
+                              on_quick_paint,
+                              quick,
+                              (GDestroyNotify) quick_paint_free);
+}
+
+static void
+output_job_clear (OutputJob *job)
+{
+  g_free (job->key);
+  g_clear_object (&job->texture);
+}
+
+/* Scales the source so it covers the output and crops the center */
+static gpointer
+scale_to_output (gpointer user_data)
+{
+  OutputJob *job = user_data;
+  g_autoptr (GdkPixbuf) pixbuf = NULL;
+  int src_width = gdk_pixbuf_get_width (job->source);
+  int src_height = gdk_pixbuf_get_height (job->source);
+  double scale;
+
+  scale = MAX ((double) job->width / src_width, (double) job->height / src_height);
+  pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB,
+                           gdk_pixbuf_get_has_alpha (job->source),
+                           8,
+                           job->width,
+                           job->height);
+  if (!pixbuf)
+    return NULL;
+
+  gdk_pixbuf_scale (job->source,
+                    pixbuf,
+                    0, 0,
+                    job->width, job->height,
+                    (job->width - src_width * scale) / 2,
+                    (job->height - src_height * scale) / 2,
+                    scale, scale,
+                    GDK_INTERP_BILINEAR);
+
+  job->texture = gdk_texture_new_for_pixbuf (pixbuf);
+  if (job->key)
+    pmp_texture_cache_insert (job->key, job->texture);
+
+  return NULL;
+}
+
+/* Monitors usually differ in size so scale for each of them in parallel */
+static void
+run_output_jobs (GPtrArray *jobs)
+{
+  g_autofree GThread **threads = g_new0 (GThread *, jobs->len);
+  guint i;
+
+  for (i = 1; i < jobs->len; i++) {
+    threads[i] = g_thread_try_new ("pmp-preview", scale_to_output, g_ptr_array_index (jobs, i), NULL);
+    if (!threads[i])
+      scale_to_output (g_ptr_array_index (jobs, i));
+  }
+
+  if (jobs->len)
+    scale_to_output (g_ptr_array_index (jobs, 0));
+
+  for (i = 1; i < jobs->len; i++) {
+    if (threads[i])
+      g_thread_join (threads[i]);
+  }
+}
+
+/*
+ * Whether the thumbnail of a @width x @height image covers all @jobs.
+ * Thumbnails are scaled to fit PREVIEW_THUMBNAIL_MAX and the embedded
+ * orientation may swap the sides so only count on the shorter one.
+ */
+static gboolean
+thumbnail_can_cover (int width, int height, GPtrArray *jobs)
+{
+  double scale = MIN (1.0, (double) PREVIEW_THUMBNAIL_MAX / MAX (width, height));
+  int side = MIN (width, height) * scale;
+  guint i;
+
+  for (i = 0; i < jobs->len; i++) {
+    OutputJob *job = g_ptr_array_index (jobs, i);
+
+    if (MAX (job->width, job->height) > side)
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+/*
+ * Used when the image can't be decoded within the budget: the cached
+ * thumbnail, a newly generated one or a plain placeholder.
+ */
+static GdkPixbuf *
+get_fallback (RenderData *data, GFileInfo *info, GCancellable *cancellable)
+{
+  GdkPixbuf *pixbuf = NULL;
+
+  if (info) {
+    pixbuf = lookup_thumbnail (data, info);
+    if (!pixbuf)
+      pixbuf = create_thumbnail (data, info, cancellable);
+  }
+
+  if (!pixbuf) {
+    pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, FALSE, 8, 1, 1);
+    gdk_pixbuf_fill (pixbuf, 0x808080ff);
+  }
+
+  return pixbuf;
+}
+
+/* Whether @source covers all @jobs without upscaling */
+static gboolean
+covers_jobs (GdkPixbuf *source, GPtrArray *jobs)
+{
+  guint i;
+
+  for (i = 0; i < jobs->len; i++) {
+    OutputJob *job = g_ptr_array_index (jobs, i);
+
+    if (job->width > gdk_pixbuf_get_width (source) || job->height > gdk_pixbuf_get_height (source))
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+static void
+render_thread (GTask        *task,
+               gpointer      source_object,
+               gpointer      task_data,
+               GCancellable *cancellable)
+{
+  RenderData *data = task_data;
+  g_autoptr (GFile) file = g_file_new_for_uri (data->uri);
+  g_autoptr (GFileInfo) info = NULL;
   g_autoptr (GdkPixbuf) pixbuf = NULL;
-  GdkRectangle monitor_layout;
-  GdkDisplay *display;
+  g_autoptr (GArray) jobs = NULL;
+  g_autoptr (GPtrArray) pending = g_ptr_array_new ();
+  DecodeData decode = { 0 };
+  GdkPixbufFormat *format;
+  GPtrArray *textures;
+  GError *error = NULL;
+  gint64 start = g_get_monotonic_time ();
+  gboolean use_thumbnail;
+  int size = 0, width = 0, height = 0;
+  guint i;
+
+  info = g_file_query_info (file,
+                            G_FILE_ATTRIBUTE_STANDARD_CONTENT_TYPE "," G_FILE_ATTRIBUTE_TIME_MODIFIED,
+                            G_FILE_QUERY_INFO_NONE,
+                            cancellable,
+                            NULL);
+
+  jobs = g_array_sized_new (FALSE, TRUE, sizeof (OutputJob), data->outputs->len);
+  g_array_set_clear_func (jobs, (GDestroyNotify) output_job_clear);
+  g_array_set_size (jobs, data->outputs->len);
+
+  for (i = 0; i < data->outputs->len; i++) {
+    PmpWallpaperOutput *output = &g_array_index (data->outputs, PmpWallpaperOutput, i);
+    OutputJob *job = &g_array_index (jobs, OutputJob, i);
+
+    job->width = output->width;
+    job->height = output->height;
+
+    /* Decoded textures are shared with other previews of the same image */
+    if (info) {
+      job->key = g_strdup_printf ("%s %" G_GUINT64_FORMAT " %dx%d",
+                                  data->uri,
+                                  g_file_info_get_attribute_uint64 (info,
+                                                                    G_FILE_ATTRIBUTE_TIME_MODIFIED),
+                                  job->width,
+                                  job->height);
+      job->texture = pmp_texture_cache_lookup (job->key);
+    }
+
+    if (!job->texture) {
+      g_ptr_array_add (pending, job);
+      size = MAX (size, MAX (job->width, job->height));
+    }
+  }
+
+  /* Decode once, large enough for all outputs */
+  if (pending->len) {
+    format = probe_image (file, &width, &height);
+
+    /* Small previews are served from the thumbnail cache */
+    use_thumbnail = info && size <= PREVIEW_THUMBNAIL_MAX;
+    if (use_thumbnail)
+      pixbuf = lookup_thumbnail (data, info);
+
+    /* Thumbnails are scaled to fit so e.g. portrait buckets of landscape
+     * images need more, decode the original rather than upscaling */
+    if (pixbuf && !covers_jobs (pixbuf, pending)) {
+      g_clear_object (&pixbuf);
+      use_thumbnail = FALSE;
+    }
+
+    /* Generating a thumbnail that can't be used costs a full decode */
+    if (!pixbuf && use_thumbnail && format && !thumbnail_can_cover (width, height, pending))
+      use_thumbnail = FALSE;
+
+    /* Other loaders decode the whole image for the coarse version too,
+     * just show the final one as early as that would be done */
+    if (!pixbuf && data->quick && can_scale_on_decode (format))
+      render_quick (task, data, file);
+
+    if (!pixbuf && use_thumbnail) {
+      pixbuf = create_thumbnail (data, info, cancellable);
+      if (pixbuf && !covers_jobs (pixbuf, pending))
+        g_clear_object (&pixbuf);
+    }
+
+    if (!pixbuf) {
+      decode.size = size;
+      pixbuf = decode_image (data, file, &decode, cancellable, &error);
+    }
+
+    if (!pixbuf && g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NO_SPACE)) {
+      g_debug ("%s, using a fallback", error->message);
+      g_clear_error (&error);
+      pixbuf = get_fallback (data, info, cancellable);
+      decode.degraded = TRUE;
+    }
+
+    if (!pixbuf) {
+      budget_release (decode.reserved);
+      g_task_return_error (task, error);
+      return;
+    }
+
+    for (i = 0; i < pending->len; i++) {
+      OutputJob *job = g_ptr_array_index (pending, i);
+
+      job->source = pixbuf;
+      /* Don't let lower quality results stick around in the cache */
+      if (decode.degraded)
+        g_clear_pointer (&job->key, g_free);
+    }
+    run_output_jobs (pending);
+
+    g_debug ("Rendered %u of %u previews of %s from %dx%d in %.1f ms, "
+             "peak decode memory %" G_GSIZE_FORMAT " KiB",
+             pending->len, jobs->len, data->uri,
+             gdk_pixbuf_get_width (pixbuf), gdk_pixbuf_get_height (pixbuf),
+             (g_get_monotonic_time () - start) / 1000.0,
+             budget_get_peak () / 1024);
+
+    /* The decoded image isn't needed once the textures exist */
+    for (i = 0; i < pending->len; i++)
+      ((OutputJob *) g_ptr_array_index (pending, i))->source = NULL;
+    g_clear_object (&pixbuf);
+    budget_release (decode.reserved);
+  }
+
+  textures = g_ptr_array_new_full (jobs->len, g_object_unref);
+  for (i = 0; i < jobs->len; i++) {
+    OutputJob *job = &g_array_index (jobs, OutputJob, i);
+
+    if (!job->texture) {
+      g_ptr_array_unref (textures);
+      g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED,
+                               "Failed to scale %s to %dx%d", data->uri, job->width, job->height);
+      return;
+    }
+    g_ptr_array_add (textures, g_steal_pointer (&job->texture));
+  }
+
+  g_task_return_pointer (task, textures, (GDestroyNotify) g_ptr_array_unref);
+}
+
+static void
+on_after_paint (GdkFrameClock *frame_clock, PmpWallpaperPreview *self)
+{
+  g_signal_handlers_disconnect_by_func (frame_clock, on_after_paint, self);
+
+  g_debug ("Preview %s painted after %.1f ms",
+           self->have_final ? "final" : "first",
+           (g_get_monotonic_time () - self->start_time) / 1000.0);
+}
+
+/* Sets one texture per monitor, a single texture is used for all of them */
+static void
+set_textures (PmpWallpaperPreview *self, GPtrArray *textures, gboolean final)
+{
+  GdkFrameClock *frame_clock;
+  guint i;
+
+  /* The full render might have won the race */
+  if (!final && self->have_final)
+    return;
+
+  for (i = 0; i < self->pictures->len; i++) {
+    GdkTexture *texture;
+
+    if (textures->len == 1)
+      texture = g_ptr_array_index (textures, 0);
+    else if (i < textures->len)
+      texture = g_ptr_array_index (textures, i);
+    else
+      break;
+
+    gtk_picture_set_paintable (g_ptr_array_index (self->pictures, i), GDK_PAINTABLE (texture));
+  }
+
+  /* Record time to first and final paint once per image */
+  frame_clock = gtk_widget_get_frame_clock (GTK_WIDGET (self->monitor_stack));
+  if (frame_clock && ((final && !self->have_final) || (!final && !self->have_quick))) {
+    g_signal_handlers_disconnect_by_func (frame_clock, on_after_paint, self);
+    g_signal_connect_object (frame_clock, "after-paint", G_CALLBACK (on_after_paint), self, 0);
+  }
+
+  if (final)
+    self->have_final = TRUE;
+  else
+    self->have_quick = TRUE;
+}
+
+static void
+on_render_done_cb (GObject      *source_object,
+                   GAsyncResult *result,
+                   gpointer      data)
+{
+  PmpWallpaperPreview *self;
+  g_autoptr (GPtrArray) textures = NULL;
+  g_autoptr (GError) error = NULL;
+
+  /* Fails with G_IO_ERROR_CANCELLED if the preview is gone */
+  textures = g_task_propagate_pointer (G_TASK (result), &error);
+  if (!textures) {
+    if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+      g_warning ("Failed to render preview: %s", error->message);
+    return;
+  }
+
+  self = PMP_WALLPAPER_PREVIEW (data);
+  set_textures (self, textures, TRUE);
+}
+
+/* Slideshows need GnomeBG to pick the current slide */
+static void
+render_slideshow (PmpWallpaperPreview *self)
+{
+  g_autoptr (GPtrArray) textures = g_ptr_array_new_with_free_func (g_object_unref);
   GListModel *monitors;
+  guint i;
+
+  monitors = gdk_display_get_monitors (gtk_widget_get_display (GTK_WIDGET (self)));
+
+  for (i = 0; i < self->buckets->len && i < g_list_model_get_n_items (monitors); i++) {
+    PmpWallpaperOutput *bucket = &g_array_index (self->buckets, PmpWallpaperOutput, i);
+    g_autoptr (GdkMonitor) monitor = g_list_model_get_item (monitors, i);
+    g_autoptr (GdkPixbuf) pixbuf = NULL;
+    GdkRectangle monitor_layout;
 
-  display = gtk_widget_get_display (GTK_WIDGET (drawing_area));
-  monitors = gdk_display_get_monitors (display);
-  monitor = g_list_model_get_item (monitors, 0);
-  gdk_monitor_get_geometry (monitor, &monitor_layout);
+    gdk_monitor_get_geometry (monitor, &monitor_layout);
+    pixbuf = gnome_bg_create_thumbnail (self->bg,
+                                        self->thumbnail_factory,
+                                        &monitor_layout,
+                                        bucket->width,
+                                        bucket->height);
+    if (!pixbuf)
+      return;
 
-  pixbuf = gnome_bg_create_thumbnail (self->bg,
-                                      self->thumbnail_factory,
-                                      &monitor_layout,
-                                      width,
-                                      height);
-  gdk_cairo_set_source_pixbuf (cr, pixbuf, 0, 0);
-  cairo_paint (cr);
+    g_ptr_array_add (textures, gdk_texture_new_for_pixbuf (pixbuf));
+  }
+
+  if (textures->len)
+    set_textures (self, textures, TRUE);
+}
+
+static gboolean
+render_thumbnail (gpointer data)
+{
+  PmpWallpaperPreview *self = PMP_WALLPAPER_PREVIEW (data);
+  g_autoptr (GTask) task = NULL;
+  RenderData *render_data;
+
+  self->render_id = 0;
+
+  g_cancellable_cancel (self->cancellable);
+  g_clear_object (&self->cancellable);
+
+  if (gnome_bg_changes_with_time (self->bg)) {
+    render_slideshow (self);
+    return G_SOURCE_REMOVE;
+  }
+
+  render_data = g_new0 (RenderData, 1);
+  render_data->uri = g_strdup (self->uri);
+  render_data->factory = g_object_ref (self->thumbnail_factory);
+  /* Buckets are replaced, never modified, so sharing them is fine */
+  render_data->outputs = g_array_ref (self->buckets);
+  /* Keep showing what we have when only the size changed */
+  render_data->quick = !self->have_final && !self->have_quick;
+  render_data->preview = self;
+
+  self->cancellable = g_cancellable_new ();
+  render_data->cancellable = g_object_ref (self->cancellable);
+  task = g_task_new (NULL, self->cancellable, on_render_done_cb, self);
+  g_task_set_source_tag (task, render_thumbnail);
+  g_task_set_task_data (task, render_data, (GDestroyNotify) render_data_free);
+  pmp_io_pool_run (task, render_thread);
+
+  return G_SOURCE_REMOVE;
+}
+
+static int
+round_to_bucket (int size)
+{
+  return (MAX (size, 1) + PREVIEW_BUCKET_SIZE - 1) / PREVIEW_BUCKET_SIZE * PREVIEW_BUCKET_SIZE;
+}
+
+/* The size of each monitor's page, letterboxed into the preview */
+static GArray *
+get_buckets (PmpWallpaperPreview *self, int width, int height)
+{
+  GListModel *monitors = gdk_display_get_monitors (gtk_widget_get_display (GTK_WIDGET (self)));
+  GArray *buckets = g_array_new (FALSE, FALSE, sizeof (PmpWallpaperOutput));
+  guint i;
+
+  for (i = 0; i < g_list_model_get_n_items (monitors); i++) {
+    g_autoptr (GdkMonitor) monitor = g_list_model_get_item (monitors, i);
+    PmpWallpaperOutput bucket;
+    GdkRectangle geometry;
+    double aspect;
+
+    gdk_monitor_get_geometry (monitor, &geometry);
+    aspect = (double) MAX (geometry.width, 1) / MAX (geometry.height, 1);
+
+    bucket.width = round_to_bucket (MIN (width, (int) (height * aspect)));
+    bucket.height = round_to_bucket (MIN (height, (int) (width / aspect)));
+    g_array_append_val (buckets, bucket);
+  }
+
+  return buckets;
+}
+
+/* Renders the thumbnails again if the image or the size buckets changed */
+static void
+update_thumbnail (PmpWallpaperPreview *self, gboolean force)
+{
+  int scale = gtk_widget_get_scale_factor (GTK_WIDGET (self));
+  int width = gtk_widget_get_width (GTK_WIDGET (self->monitor_stack)) * scale;
+  int height = gtk_widget_get_height (GTK_WIDGET (self->monitor_stack)) * scale;
+  g_autoptr (GArray) buckets = NULL;
+
+  if (!self->uri || width <= 0 || height <= 0)
+    return;
+
+  buckets = get_buckets (self, width, height);
+
+  if (!force && self->buckets && self->buckets->len == buckets->len &&
+      memcmp (self->buckets->data, buckets->data, buckets->len * sizeof (PmpWallpaperOutput)) == 0)
+    return;
+
+  g_clear_pointer (&self->buckets, g_array_unref);
+  self->buckets = g_steal_pointer (&buckets);
+
+  /* We're within size allocation, don't touch the pictures yet */
+  if (!self->render_id) {
+    self->render_id = g_idle_add (render_thumbnail, self);
+    g_source_set_name_by_id (self->render_id, "[pmp] render wallpaper preview");
+  }
+}
+
+/* Shows the page of the monitor the preview is on */
+static void
+update_visible_monitor (PmpWallpaperPreview *self)
+{
+  GdkDisplay *display = gtk_widget_get_display (GTK_WIDGET (self));
+  GListModel *monitors = gdk_display_get_monitors (display);
+  GdkMonitor *current = NULL;
+  GtkNative *native;
+  guint i;
+
+  native = gtk_widget_get_native (GTK_WIDGET (self));
+  if (native && gtk_native_get_surface (native))
+    current = gdk_display_get_monitor_at_surface (display, gtk_native_get_surface (native));
+
+  for (i = 0; i < self->pictures->len; i++) {
+    g_autoptr (GdkMonitor) monitor = g_list_model_get_item (monitors, i);
+
+    if (monitor == current || !current) {
+      gtk_stack_set_visible_child (self->monitor_stack,
+                                   gtk_widget_get_parent (g_ptr_array_index (self->pictures, i)));
+      return;
+    }
+  }
+}
+
+/* Adds a page per monitor with the monitor's aspect ratio */
+static void
+update_monitor_pages (PmpWallpaperPreview *self)
+{
+  GListModel *monitors = gdk_display_get_monitors (gtk_widget_get_display (GTK_WIDGET (self)));
+  GtkWidget *child;
+  guint i;
+
+  while ((child = gtk_widget_get_first_child (GTK_WIDGET (self->monitor_stack))))
+    gtk_stack_remove (self->monitor_stack, child);
+  g_ptr_array_set_size (self->pictures, 0);
+
+  for (i = 0; i < g_list_model_get_n_items (monitors); i++) {
+    g_autoptr (GdkMonitor) monitor = g_list_model_get_item (monitors, i);
+    GdkRectangle geometry;
+    GtkWidget *frame, *picture;
+
+    gdk_monitor_get_geometry (monitor, &geometry);
+
+    picture = gtk_picture_new ();
+    gtk_picture_set_can_shrink (GTK_PICTURE (picture), TRUE);
+    gtk_picture_set_content_fit (GTK_PICTURE (picture), GTK_CONTENT_FIT_COVER);
+
+    frame = gtk_aspect_frame_new (0.5, 0.5,
+                                  (float) MAX (geometry.width, 1) / MAX (geometry.height, 1),
+                                  FALSE);
+    gtk_aspect_frame_set_child (GTK_ASPECT_FRAME (frame), picture);
+    gtk_stack_add_child (self->monitor_stack, frame);
+    g_ptr_array_add (self->pictures, picture);
+  }
+
+  /* The new pages are empty */
+  self->have_quick = FALSE;
+  self->have_final = FALSE;
+}
+
+static void
+on_monitors_changed (PmpWallpaperPreview *self)
+{
+  update_monitor_pages (self);
+  update_visible_monitor (self);
+  update_thumbnail (self, TRUE);
 }
 
 static void
@@ -123,6 +1020,66 @@ update_clock_cb (gpointer data)
   return G_SOURCE_CONTINUE;
 }
 
+static void
+pmp_wallpaper_preview_size_allocate (GtkWidget *widget, int width, int height, int baseline)
+{
+  PmpWallpaperPreview *self = PMP_WALLPAPER_PREVIEW (widget);
+
+  GTK_WIDGET_CLASS (pmp_wallpaper_preview_parent_class)->size_allocate (widget,
+                                                                        width,
+                                                                        height,
+                                                                        baseline);
+  update_thumbnail (self, FALSE);
+}
+
+/* Only tick while visible as the dialog is created ahead of time */
+static void
+pmp_wallpaper_preview_map (GtkWidget *widget)
+{
+  PmpWallpaperPreview *self = PMP_WALLPAPER_PREVIEW (widget);
+
+  GdkSurface *surface;
+
+  GTK_WIDGET_CLASS (pmp_wallpaper_preview_parent_class)->map (widget);
+
+  surface = gtk_native_get_surface (gtk_widget_get_native (widget));
+  g_signal_connect_object (surface,
+                           "enter-monitor",
+                           G_CALLBACK (update_visible_monitor),
+                           self,
+                           G_CONNECT_SWAPPED);
+  update_visible_monitor (self);
+
+  update_clock_label (self, TRUE);
+  if (!self->clock_time_timeout_id)
+    self->clock_time_timeout_id = g_timeout_add_seconds (1, update_clock_cb, self);
+}
+
+static void
+pmp_wallpaper_preview_unmap (GtkWidget *widget)
+{
+  PmpWallpaperPreview *self = PMP_WALLPAPER_PREVIEW (widget);
+
+  g_clear_handle_id (&self->clock_time_timeout_id, g_source_remove);
+  g_signal_handlers_disconnect_by_func (gtk_native_get_surface (gtk_widget_get_native (widget)),
+                                        update_visible_monitor,
+                                        self);
+
+  GTK_WIDGET_CLASS (pmp_wallpaper_preview_parent_class)->unmap (widget);
+}
+
+static void
+pmp_wallpaper_preview_dispose (GObject *object)
+{
+  PmpWallpaperPreview *self = PMP_WALLPAPER_PREVIEW (object);
+
+  g_clear_handle_id (&self->render_id, g_source_remove);
+  g_cancellable_cancel (self->cancellable);
+  g_clear_object (&self->cancellable);
+
+  G_OBJECT_CLASS (pmp_wallpaper_preview_parent_class)->dispose (object);
+}
+
 static void
 pmp_wallpaper_preview_finalize (GObject *object)
 {
@@ -130,6 +1087,11 @@ pmp_wallpaper_preview_finalize (GObject *object)
 
   g_clear_object (&self->desktop_settings);
   g_clear_object (&self->thumbnail_factory);
+  g_clear_object (&self->bg);
+  g_free (self->uri);
+  g_free (self->path);
+  g_clear_pointer (&self->buckets, g_array_unref);
+  g_clear_pointer (&self->pictures, g_ptr_array_unref);
 
   g_clear_pointer (&self->previous_time, g_date_time_unref);
 
@@ -146,6 +1108,14 @@ pmp_wallpaper_preview_init (PmpWallpaperPreview *self)
 {
   gtk_widget_init_template (GTK_WIDGET (self));
 
+  self->pictures = g_ptr_array_new ();
+  update_monitor_pages (self);
+  g_signal_connect_object (gdk_display_get_monitors (gtk_widget_get_display (GTK_WIDGET (self))),
+                           "items-changed",
+                           G_CALLBACK (on_monitors_changed),
+                           self,
+                           G_CONNECT_SWAPPED);
+
   self->desktop_settings = g_settings_new ("org.gnome.desktop.interface");
 
   g_signal_connect_object (self->desktop_settings,
@@ -155,13 +1125,11 @@ pmp_wallpaper_preview_init (PmpWallpaperPreview *self)
                            G_CONNECT_SWAPPED);
   update_clock_format (self);
 
-  self->clock_time_timeout_id = g_timeout_add_seconds (1, update_clock_cb, self);
-
   self->bg = gnome_bg_new ();
   gnome_bg_set_placement (self->bg, G_DESKTOP_BACKGROUND_STYLE_ZOOM);
 
   self->thumbnail_factory =
-    gnome_desktop_thumbnail_factory_new (GNOME_DESKTOP_THUMBNAIL_SIZE_NORMAL);
+    gnome_desktop_thumbnail_factory_new (PREVIEW_THUMBNAIL_SIZE);
 }
 
 static void
@@ -171,15 +1139,20 @@ pmp_wallpaper_preview_class_init (PmpWallpaperPreviewClass *klass)
   GtkWidgetClass *widget_class = GTK_WIDGET_CLASS (klass);
   g_autoptr (GtkCssProvider) provider = gtk_css_provider_new ();
 
+  object_class->dispose = pmp_wallpaper_preview_dispose;
   object_class->finalize = pmp_wallpaper_preview_finalize;
 
+  widget_class->map = pmp_wallpaper_preview_map;
+  widget_class->unmap = pmp_wallpaper_preview_unmap;
+  widget_class->size_allocate = pmp_wallpaper_preview_size_allocate;
+
   gtk_widget_class_set_template_from_resource (widget_class,
                                                "/mobi/phosh/portal/pmp-wallpaper-preview.ui");
 
   gtk_widget_class_bind_template_child (widget_class, PmpWallpaperPreview, stack);
   gtk_widget_class_bind_template_child (widget_class, PmpWallpaperPreview, desktop_preview);
   gtk_widget_class_bind_template_child (widget_class, PmpWallpaperPreview, animated_background_icon);
-  gtk_widget_class_bind_template_child (widget_class, PmpWallpaperPreview, drawing_area);
+  gtk_widget_class_bind_template_child (widget_class, PmpWallpaperPreview, monitor_stack);
   gtk_widget_class_bind_template_child (widget_class, PmpWallpaperPreview, desktop_clock_label);
 
 
@@ -199,20 +1172,37 @@ void
 pmp_wallpaper_preview_set_image (PmpWallpaperPreview *self,
                                  const gchar         *image_uri)
 {
-  g_autofree char *path = NULL;
   g_autoptr (GFile) image_file = NULL;
 
   image_file = g_file_new_for_uri (image_uri);
-  path = g_file_get_path (image_file);
-  gnome_bg_set_filename (self->bg, path);
+  self->start_time = g_get_monotonic_time ();
+  self->have_quick = FALSE;
+  self->have_final = FALSE;
+  g_free (self->uri);
+  self->uri = g_strdup (image_uri);
+  g_free (self->path);
+  self->path = g_file_get_path (image_file);
+  gnome_bg_set_filename (self->bg, self->path);
 
   gtk_widget_set_visible (self->animated_background_icon,
                           gnome_bg_changes_with_time (self->bg));
   gtk_stack_set_visible_child (GTK_STACK (self->stack), self->desktop_preview);
 
-  gtk_drawing_area_set_draw_func (GTK_DRAWING_AREA (self->drawing_area),
-                                  draw_preview_func,
-                                  self,
-                                  NULL);
-  gtk_widget_queue_draw (self->drawing_area);
+  update_thumbnail (self, TRUE);
+}
+
+/**
+ * pmp_wallpaper_preview_set_memory_budget:
+ * @bytes: The budget in bytes
+ *
+ * Sets the memory all previews of the process may use for decoding at
+ * the same time. Decodes that don't fit get scaled down further, images
+ * that don't fit at all are previewed from their thumbnail.
+ */
+void
+pmp_wallpaper_preview_set_memory_budget (guint64 bytes)
+{
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&budget_lock);
+
+  budget_max = MIN (bytes, G_MAXSIZE);
 }
@@ -21,3 +21,4 @@ G_DECLARE_FINAL_TYPE (PmpWallpaperPreview, pmp_wallpaper_preview, PMP, WALLPAPER
 PmpWallpaperPreview *pmp_wallpaper_preview_new (void);
 void                 pmp_wallpaper_preview_set_image (PmpWallpaperPreview *self,
                                                       const gchar         *image_uri);
+void                 pmp_wallpaper_preview_set_memory_budget (guint64 bytes);
@@ -0,0 +1,483 @@
+/*
+ * Copyright © 2024 The Phosh Developers
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "pmp-config.h"
+
+#include "pmp-file-copy.h"
+#include "pmp-wallpaper-store.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib/gstdio.h>
+
+/* Recently applied wallpapers we keep around for switching back */
+#define STORE_MAX_ENTRIES  8
+#define STORE_MAX_BYTES    (256 * 1024 * 1024)
+
+#define HASH_BUFFER_SIZE   (64 * 1024)
+
+/* Settings that might point into the store, these images must stay */
+static const struct {
+  const char *schema;
+  const char *key;
+} referencing_keys[] = {
+  { "org.gnome.desktop.background", "picture-uri" },
+  { "org.gnome.desktop.background", "picture-uri-dark" },
+  { "org.gnome.desktop.screensaver", "picture-uri" },
+};
+
+/* Serializes store modifications between the I/O pool's threads */
+static GMutex store_lock;
+/* Images in use by a request, by hash. Protected by store_lock. */
+static GHashTable *pins;
+
+typedef struct {
+  guint    count;
+  /* Copied in by a request and not committed to the settings yet */
+  gboolean added;
+} StorePin;
+
+typedef struct {
+  char   *path;
+  gint64  mtime;
+  goffset size;
+} StoreEntry;
+
+static void
+store_entry_free (StoreEntry *entry)
+{
+  g_free (entry->path);
+  g_free (entry);
+}
+
+static char *
+get_store_dir (void)
+{
+  return g_build_filename (g_get_user_data_dir (), "xdg-desktop-portal-phosh", "wallpapers", NULL);
+}
+
+static char *
+hash_file (GFile *file, GCancellable *cancellable, GError **error)
+{
+  g_autoptr (GFileInputStream) stream = NULL;
+  g_autoptr (GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  g_autofree guchar *buffer = g_malloc (HASH_BUFFER_SIZE);
+  gssize n_read;
+
+  stream = g_file_read (file, cancellable, error);
+  if (!stream)
+    return NULL;
+
+  while ((n_read = g_input_stream_read (G_INPUT_STREAM (stream), buffer, HASH_BUFFER_SIZE,
+                                        cancellable, error)) > 0)
+    g_checksum_update (checksum, buffer, n_read);
+
+  if (n_read < 0)
+    return NULL;
+
+  return g_strdup (g_checksum_get_string (checksum));
+}
+
+/* Keep the extension so e.g. slideshow XML files are still recognized */
+static char *
+get_extension (GFile *file)
+{
+  g_autofree char *basename = g_file_get_basename (file);
+  const char *dot = basename ? strrchr (basename, '.') : NULL;
+
+  if (!dot || dot == basename || strlen (dot) > 6 || strchr (dot, G_DIR_SEPARATOR))
+    return g_strdup ("");
+
+  return g_ascii_strdown (dot, -1);
+}
+
+static int
+compare_entries_newest_first (gconstpointer a, gconstpointer b)
+{
+  const StoreEntry *entry_a = *(StoreEntry **)a;
+  const StoreEntry *entry_b = *(StoreEntry **)b;
+
+  if (entry_a->mtime == entry_b->mtime)
+    return 0;
+
+  return entry_a->mtime < entry_b->mtime ? 1 : -1;
+}
+
+/* The content hash an image or one of its variants is stored under */
+static char *
+get_hash (const char *name)
+{
+  return g_strndup (name, strcspn (name, ".@"));
+}
+
+/* Hashes of the stored images the settings point at, directly or via a variant */
+static GHashTable *
+get_referenced_hashes (const char *dir)
+{
+  GSettingsSchemaSource *source = g_settings_schema_source_get_default ();
+  GHashTable *referenced = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (referencing_keys); i++) {
+    g_autoptr (GSettingsSchema) schema = NULL;
+    g_autoptr (GSettings) settings = NULL;
+    g_autofree char *uri = NULL;
+    g_autofree char *path = NULL;
+    g_autofree char *path_dir = NULL;
+    g_autofree char *basename = NULL;
+
+    if (source)
+      schema = g_settings_schema_source_lookup (source, referencing_keys[i].schema, TRUE);
+    if (!schema || !g_settings_schema_has_key (schema, referencing_keys[i].key))
+      continue;
+
+    settings = g_settings_new_full (schema, NULL, NULL);
+    uri = g_settings_get_string (settings, referencing_keys[i].key);
+    path = g_filename_from_uri (uri, NULL, NULL);
+    if (!path)
+      continue;
+
+    path_dir = g_path_get_dirname (path);
+    if (g_strcmp0 (path_dir, dir) != 0)
+      continue;
+
+    basename = g_path_get_basename (path);
+    g_hash_table_add (referenced, get_hash (basename));
+  }
+
+  return referenced;
+}
+
+/* Evict the least recently used images exceeding the quota, never pinned
+ * images or images the settings still use. Variants count towards the
+ * quota and go together with their image. */
+static void
+prune_store (const char *dir)
+{
+  g_autoptr (GPtrArray) entries = g_ptr_array_new_with_free_func ((GDestroyNotify) store_entry_free);
+  g_autoptr (GPtrArray) variants = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr (GHashTable) variant_sizes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  g_autoptr (GHashTable) kept = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  g_autoptr (GHashTable) referenced = NULL;
+  g_autoptr (GDir) gdir = NULL;
+  const char *name;
+  goffset total = 0;
+  guint i;
+
+  gdir = g_dir_open (dir, 0, NULL);
+  if (!gdir)
+    return;
+
+  while ((name = g_dir_read_name (gdir))) {
+    StoreEntry *entry;
+    GStatBuf st;
+    g_autofree char *path = NULL;
+
+    /* Skip in progress copies */
+    if (name[0] == '.')
+      continue;
+
+    path = g_build_filename (dir, name, NULL);
+    if (g_stat (path, &st) != 0 || !S_ISREG (st.st_mode))
+      continue;
+
+    if (strchr (name, '@')) {
+      g_autofree char *hash = get_hash (name);
+      goffset *size = g_hash_table_lookup (variant_sizes, hash);
+
+      if (!size) {
+        size = g_new0 (goffset, 1);
+        g_hash_table_insert (variant_sizes, g_steal_pointer (&hash), size);
+      }
+      *size += st.st_size;
+      g_ptr_array_add (variants, g_steal_pointer (&path));
+      continue;
+    }
+
+    entry = g_new0 (StoreEntry, 1);
+    entry->path = g_steal_pointer (&path);
+    entry->mtime = st.st_mtime;
+    entry->size = st.st_size;
+    g_ptr_array_add (entries, entry);
+  }
+
+  g_ptr_array_sort (entries, compare_entries_newest_first);
+  referenced = get_referenced_hashes (dir);
+
+  for (i = 0; i < entries->len; i++) {
+    StoreEntry *entry = g_ptr_array_index (entries, i);
+    g_autofree char *basename = g_path_get_basename (entry->path);
+    g_autofree char *hash = get_hash (basename);
+    goffset *variants_size = g_hash_table_lookup (variant_sizes, hash);
+    goffset size = entry->size + (variants_size ? *variants_size : 0);
+
+    if (g_hash_table_contains (pins, hash) || g_hash_table_contains (referenced, hash) ||
+        (g_hash_table_size (kept) < STORE_MAX_ENTRIES && total + size <= STORE_MAX_BYTES)) {
+      g_hash_table_add (kept, g_steal_pointer (&hash));
+      total += size;
+      continue;
+    }
+
+    g_debug ("Evicting %s from wallpaper store", entry->path);
+    if (g_unlink (entry->path) != 0)
+      g_warning ("Failed to remove %s: %s", entry->path, g_strerror (errno));
+  }
+
+  for (i = 0; i < variants->len; i++) {
+    const char *path = g_ptr_array_index (variants, i);
+    g_autofree char *basename = g_path_get_basename (path);
+    g_autofree char *hash = get_hash (basename);
+
+    if (g_hash_table_contains (kept, hash))
+      continue;
+
+    if (g_unlink (path) != 0)
+      g_warning ("Failed to remove %s: %s", path, g_strerror (errno));
+  }
+}
+
+/* Removes a stored image and all its variants, needs the store_lock */
+static void
+remove_image (const char *path)
+{
+  g_autofree char *dir = g_path_get_dirname (path);
+  g_autofree char *basename = g_path_get_basename (path);
+  g_autofree char *hash = get_hash (basename);
+  g_autofree char *prefix = g_strconcat (hash, "@", NULL);
+  g_autoptr (GDir) gdir = NULL;
+  const char *name;
+
+  g_debug ("Removing %s from wallpaper store", path);
+  if (g_unlink (path) != 0 && errno != ENOENT)
+    g_warning ("Failed to remove %s: %s", path, g_strerror (errno));
+
+  gdir = g_dir_open (dir, 0, NULL);
+  if (!gdir)
+    return;
+
+  while ((name = g_dir_read_name (gdir))) {
+    g_autofree char *variant_path = NULL;
+
+    if (!g_str_has_prefix (name, prefix))
+      continue;
+
+    variant_path = g_build_filename (dir, name, NULL);
+    if (g_unlink (variant_path) != 0)
+      g_warning ("Failed to remove %s: %s", variant_path, g_strerror (errno));
+  }
+}
+
+/* Needs the store_lock */
+static void
+pin_image (const char *hash, gboolean added)
+{
+  StorePin *pin;
+
+  if (!pins)
+    pins = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+  pin = g_hash_table_lookup (pins, hash);
+  if (!pin) {
+    pin = g_new0 (StorePin, 1);
+    g_hash_table_insert (pins, g_strdup (hash), pin);
+  }
+
+  pin->count++;
+  pin->added |= added;
+}
+
+/**
+ * pmp_wallpaper_store_add:
+ * @source: The image to store
+ * @cancellable: (nullable): A cancellable
+ * @error: Return location for an error
+ *
+ * Stores @source under its content hash. The source is read only once:
+ * it's copied into the store first and the copy gets hashed, so the
+ * stored content always matches its name even if the source changes
+ * meanwhile. If the same image is already stored the copy is dropped
+ * and the image marked as recently used instead. Least recently used
+ * images are evicted to keep the store small. The stored image is
+ * pinned so it isn't evicted or removed while in use, release it with
+ * [func@wallpaper_store_unpin]. This blocks so only use it off the main
+ * thread.
+ *
+ * Returns: (transfer full): The path of the stored image
+ */
+char *
+pmp_wallpaper_store_add (GFile         *source,
+                         GCancellable  *cancellable,
+                         GError       **error)
+{
+  g_autofree char *dir = get_store_dir ();
+  g_autofree char *tmp_path = NULL;
+  g_autofree char *hash = NULL;
+  g_autofree char *extension = NULL;
+  g_autofree char *name = NULL;
+  g_autofree char *path = NULL;
+  g_autoptr (GFile) tmp_file = NULL;
+  g_autoptr (GMutexLocker) locker = NULL;
+  int fd;
+
+  if (g_mkdir_with_parents (dir, 0700) != 0) {
+    g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                 "Failed to create %s: %s", dir, g_strerror (errno));
+    return NULL;
+  }
+
+  /* Dot files are skipped when pruning */
+  tmp_path = g_build_filename (dir, ".incoming-XXXXXX", NULL);
+  fd = g_mkstemp_full (tmp_path, O_WRONLY | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                 "Failed to create %s: %s", tmp_path, g_strerror (errno));
+    return NULL;
+  }
+  close (fd);
+
+  tmp_file = g_file_new_for_path (tmp_path);
+  if (!pmp_file_copy (source, tmp_file, cancellable, error)) {
+    g_unlink (tmp_path);
+    return NULL;
+  }
+
+  hash = hash_file (tmp_file, cancellable, error);
+  if (!hash) {
+    g_unlink (tmp_path);
+    return NULL;
+  }
+
+  extension = get_extension (source);
+  name = g_strconcat (hash, extension, NULL);
+  path = g_build_filename (dir, name, NULL);
+
+  locker = g_mutex_locker_new (&store_lock);
+
+  /* Already known, just mark as recently used */
+  if (g_utime (path, NULL) == 0) {
+    g_debug ("%s already in wallpaper store", name);
+    g_unlink (tmp_path);
+    pin_image (hash, FALSE);
+    return g_steal_pointer (&path);
+  }
+
+  if (g_rename (tmp_path, path) != 0) {
+    g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                 "Failed to store %s: %s", name, g_strerror (errno));
+    g_unlink (tmp_path);
+    return NULL;
+  }
+
+  pin_image (hash, TRUE);
+  prune_store (dir);
+
+  return g_steal_pointer (&path);
+}
+
+/**
+ * pmp_wallpaper_store_unpin:
+ * @path: The path returned by [func@wallpaper_store_add]
+ * @committed: Whether the image was committed to the settings
+ *
+ * Releases a pin taken by [func@wallpaper_store_add]. Once the last pin
+ * is gone an image that was added but never committed is removed again
+ * together with its variants, unless the settings use it by now. This
+ * blocks so only use it off the main thread.
+ */
+void
+pmp_wallpaper_store_unpin (const char *path, gboolean committed)
+{
+  g_autofree char *dir = g_path_get_dirname (path);
+  g_autofree char *basename = g_path_get_basename (path);
+  g_autofree char *hash = get_hash (basename);
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&store_lock);
+  g_autoptr (GHashTable) referenced = NULL;
+  StorePin *pin = pins ? g_hash_table_lookup (pins, hash) : NULL;
+  gboolean added;
+
+  g_return_if_fail (pin);
+
+  if (committed)
+    pin->added = FALSE;
+
+  if (--pin->count > 0)
+    return;
+
+  added = pin->added;
+  g_hash_table_remove (pins, hash);
+  if (!added)
+    return;
+
+  referenced = get_referenced_hashes (dir);
+  if (g_hash_table_contains (referenced, hash))
+    return;
+
+  remove_image (path);
+}
+
+/**
+ * pmp_wallpaper_store_get_variant_path:
+ * @path: The path of a stored image
+ * @variant: The name of the variant, e.g. its size
+ * @extension: The file name extension
+ *
+ * Gets the path to store a variant of the image at @path under. The
+ * variant gets evicted together with the image.
+ *
+ * Returns: (transfer full): The variant's path
+ */
+char *
+pmp_wallpaper_store_get_variant_path (const char *path,
+                                      const char *variant,
+                                      const char *extension)
+{
+  g_autofree char *dir = g_path_get_dirname (path);
+  g_autofree char *basename = g_path_get_basename (path);
+  g_autofree char *hash = get_hash (basename);
+  g_autofree char *name = g_strdup_printf ("%s@%s.%s", hash, variant, extension);
+
+  return g_build_filename (dir, name, NULL);
+}
+
+/**
+ * pmp_wallpaper_store_find_variant:
+ * @path: The path of a stored image or one of its variants
+ * @variant: The name of the variant
+ * @extension: (nullable): The file name extension, %NULL for images
+ *
+ * Looks up a previously stored variant of an image.
+ *
+ * Returns: (transfer full) (nullable): The variant's path or %NULL if
+ *   there's no such variant or @path isn't in the store
+ */
+char *
+pmp_wallpaper_store_find_variant (const char *path, const char *variant, const char *extension)
+{
+  /* Images are JPEG unless they need an alpha channel */
+  const char *extensions[] = { "jpg", "png" };
+  g_autofree char *store_dir = get_store_dir ();
+  g_autofree char *dir = g_path_get_dirname (path);
+  guint i;
+
+  if (g_strcmp0 (dir, store_dir) != 0)
+    return NULL;
+
+  for (i = 0; i < G_N_ELEMENTS (extensions); i++) {
+    g_autofree char *variant_path = NULL;
+
+    variant_path = pmp_wallpaper_store_get_variant_path (path, variant, extension ?: extensions[i]);
+    if (g_file_test (variant_path, G_FILE_TEST_IS_REGULAR))
+      return g_steal_pointer (&variant_path);
+
+    if (extension)
+      break;
+  }
+
+  return NULL;
+}
@@ -0,0 +1,25 @@
+/*
+ * Copyright © 2024 The Phosh Developers
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+char *pmp_wallpaper_store_add              (GFile         *source,
+                                            GCancellable  *cancellable,
+                                            GError       **error);
+void  pmp_wallpaper_store_unpin            (const char    *path,
+                                            gboolean       committed);
+char *pmp_wallpaper_store_get_variant_path (const char    *path,
+                                            const char    *variant,
+                                            const char    *extension);
+char *pmp_wallpaper_store_find_variant     (const char    *path,
+                                            const char    *variant,
+                                            const char    *extension);
+
+G_END_DECLS
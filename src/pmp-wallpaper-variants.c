@@ -0,0 +1,425 @@
+/*
+ * Copyright © 2024 The Phosh Developers
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "pmp-config.h"
+
+#include "pmp-blur.h"
+#include "pmp-palette.h"
+#include "pmp-wallpaper-store.h"
+#include "pmp-wallpaper-variants.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <glib/gstdio.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+#define VARIANT_JPEG_QUALITY "90"
+
+/* Dark variant: scale by 0.63 and lift by 9 in 8.8 fixed point, which
+ * dims the image and flattens its contrast around the dark end */
+#define DARK_SCALE  161
+#define DARK_OFFSET 2304
+
+/* The blurred variant is small, the shell can scale it up without
+ * visible loss */
+#define BLURRED_SIZE   512
+#define BLURRED_RADIUS 12
+
+#define PALETTE_MAX_COLORS 5
+
+typedef enum {
+  VARIANT_KIND_BACKGROUND,
+  VARIANT_KIND_LOCK_SCREEN,
+  VARIANT_KIND_DARK,
+  VARIANT_KIND_BLURRED,
+} VariantKind;
+
+typedef struct {
+  char        *name;
+  VariantKind  kind;
+  int          width;
+  int          height;
+  char        *path;
+} Variant;
+
+static void
+variant_clear (Variant *variant)
+{
+  g_free (variant->name);
+  g_free (variant->path);
+}
+
+/*
+ * The scale needed so an image of @src_width x @src_height covers
+ * @width x @height no matter whether the decoder rotates it due to
+ * its embedded orientation.
+ */
+static double
+get_cover_scale (int src_width, int src_height, int width, int height)
+{
+  double scale = MAX ((double) width / src_width, (double) height / src_height);
+
+  return MAX (scale, MAX ((double) width / src_height, (double) height / src_width));
+}
+
+static GdkPixbuf *
+scale_to_cover (GdkPixbuf *pixbuf, int width, int height, gboolean crop)
+{
+  g_autoptr (GdkPixbuf) scaled = NULL;
+  int src_width = gdk_pixbuf_get_width (pixbuf);
+  int src_height = gdk_pixbuf_get_height (pixbuf);
+  double scale = MAX ((double) width / src_width, (double) height / src_height);
+  int scaled_width = MAX (width, (int) (src_width * scale + 0.5));
+  int scaled_height = MAX (height, (int) (src_height * scale + 0.5));
+
+  if (scale < 1.0 && (scaled_width != src_width || scaled_height != src_height)) {
+    scaled = gdk_pixbuf_scale_simple (pixbuf, scaled_width, scaled_height, GDK_INTERP_BILINEAR);
+  } else {
+    scaled = g_object_ref (pixbuf);
+    scaled_width = src_width;
+    scaled_height = src_height;
+  }
+
+  if (!crop)
+    return g_steal_pointer (&scaled);
+
+  width = MIN (width, scaled_width);
+  height = MIN (height, scaled_height);
+  return gdk_pixbuf_new_subpixbuf (scaled,
+                                   (scaled_width - width) / 2,
+                                   (scaled_height - height) / 2,
+                                   width,
+                                   height);
+}
+
+static GdkPixbuf *
+create_dark (GdkPixbuf *pixbuf)
+{
+  int width = gdk_pixbuf_get_width (pixbuf);
+  int height = gdk_pixbuf_get_height (pixbuf);
+  int n_channels = gdk_pixbuf_get_n_channels (pixbuf);
+  gboolean has_alpha = gdk_pixbuf_get_has_alpha (pixbuf);
+  int src_stride = gdk_pixbuf_get_rowstride (pixbuf);
+  const guint8 *src = gdk_pixbuf_read_pixels (pixbuf);
+  g_autoptr (GdkPixbuf) dark = NULL;
+  int dst_stride, row_len, x, y;
+  guint8 *dst;
+
+  dark = gdk_pixbuf_new (GDK_COLORSPACE_RGB, has_alpha, 8, width, height);
+  if (!dark)
+    return NULL;
+
+  dst_stride = gdk_pixbuf_get_rowstride (dark);
+  dst = gdk_pixbuf_get_pixels (dark);
+  row_len = width * n_channels;
+
+  for (y = 0; y < height; y++) {
+    const guint8 *s = src + (gsize) y * src_stride;
+    guint8 *d = dst + (gsize) y * dst_stride;
+
+    /* Treat all channels alike so the compiler can vectorize the loop */
+    for (x = 0; x < row_len; x++)
+      d[x] = (s[x] * DARK_SCALE + DARK_OFFSET) >> 8;
+
+    if (has_alpha) {
+      for (x = 3; x < row_len; x += 4)
+        d[x] = s[x];
+    }
+  }
+
+  return g_steal_pointer (&dark);
+}
+
+static char *
+save_variant (GdkPixbuf *pixbuf, const char *path, const char *name, GError **error)
+{
+  gboolean has_alpha = gdk_pixbuf_get_has_alpha (pixbuf);
+  g_autofree char *variant_path = NULL;
+  g_autofree char *dirname = NULL;
+  g_autofree char *basename = NULL;
+  g_autofree char *tmp_name = NULL;
+  g_autofree char *tmp_path = NULL;
+  gboolean success;
+  int fd;
+
+  variant_path = pmp_wallpaper_store_get_variant_path (path, name, has_alpha ? "png" : "jpg");
+  dirname = g_path_get_dirname (variant_path);
+  basename = g_path_get_basename (variant_path);
+  tmp_name = g_strdup_printf (".%s-XXXXXX", basename);
+  tmp_path = g_build_filename (dirname, tmp_name, NULL);
+
+  fd = g_mkstemp_full (tmp_path, O_WRONLY | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                 "Failed to create %s: %s", tmp_path, g_strerror (errno));
+    return NULL;
+  }
+  close (fd);
+
+  /* Baseline JPEG decodes a lot faster than e.g. PNG */
+  if (has_alpha)
+    success = gdk_pixbuf_save (pixbuf, tmp_path, "png", error, NULL);
+  else
+    success = gdk_pixbuf_save (pixbuf, tmp_path, "jpeg", error, "quality", VARIANT_JPEG_QUALITY, NULL);
+
+  if (success && g_rename (tmp_path, variant_path) != 0) {
+    g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                 "Failed to rename %s: %s", tmp_path, g_strerror (errno));
+    success = FALSE;
+  }
+
+  if (!success) {
+    g_unlink (tmp_path);
+    return NULL;
+  }
+
+  return g_steal_pointer (&variant_path);
+}
+
+/* Variants that alter pixels are needed even if the image needs no scaling */
+static gboolean
+variant_alters_pixels (Variant *variant)
+{
+  return variant->kind == VARIANT_KIND_DARK || variant->kind == VARIANT_KIND_BLURRED;
+}
+
+static void
+add_variant (GArray *variants, char *name, VariantKind kind, int width, int height)
+{
+  Variant variant = { name, kind, width, height, NULL };
+  guint i;
+
+  for (i = 0; i < variants->len; i++) {
+    if (g_str_equal (g_array_index (variants, Variant, i).name, variant.name)) {
+      variant_clear (&variant);
+      return;
+    }
+  }
+
+  g_array_append_val (variants, variant);
+}
+
+/**
+ * pmp_wallpaper_variants_create:
+ * @path: A stored wallpaper
+ * @outputs: (element-type PmpWallpaperOutput): The outputs to render for
+ * @flags: The variants to create
+ * @cancellable: (nullable): A cancellable
+ * @error: Return location for an error
+ *
+ * Creates variants of the wallpaper at @path pre-scaled to the
+ * @outputs so the shell doesn't need to scale down large images on
+ * every start and unlock. With %PMP_WALLPAPER_VARIANTS_FLAG_BACKGROUND
+ * a background variant that covers all outputs in either orientation is
+ * created as well as a dimmed one for dark mode. With
+ * %PMP_WALLPAPER_VARIANTS_FLAG_LOCK_SCREEN a lock screen variant
+ * cropped to the first output is created. With
+ * %PMP_WALLPAPER_VARIANTS_FLAG_BLURRED a small blurred variant is
+ * created too. The image's dominant colors are saved as palette.
+ * Backgrounds and lock screen images that weren't asked for are set to
+ * @path.
+ * The image is decoded only once for all of them. Variants already in
+ * the store are reused. Images that are already small enough are used
+ * as is, images that can't be decoded (e.g. slideshows) get no variants
+ * at all. This blocks so only use it off the main thread.
+ *
+ * Returns: (transfer full): The variants to use
+ */
+PmpWallpaperVariants *
+pmp_wallpaper_variants_create (const char                 *path,
+                               GArray                     *outputs,
+                               PmpWallpaperVariantsFlags   flags,
+                               GCancellable               *cancellable,
+                               GError                    **error)
+{
+  g_autoptr (PmpWallpaperVariants) result = g_new0 (PmpWallpaperVariants, 1);
+  g_autoptr (GArray) variants = g_array_new (FALSE, FALSE, sizeof (Variant));
+  g_autoptr (GdkPixbuf) decoded = NULL;
+  g_autoptr (GdkPixbuf) pixbuf = NULL;
+  GdkPixbufFormat *format;
+  PmpWallpaperOutput *output;
+  int src_width, src_height, largest = 0;
+  g_autofree char *palette_path = NULL;
+  double decode_scale = 0.0;
+  gboolean all_stored = TRUE;
+  guint i;
+
+  g_array_set_clear_func (variants, (GDestroyNotify) variant_clear);
+
+  result->background = g_strdup (path);
+  result->background_dark = g_strdup (path);
+  result->lock_screen = g_strdup (path);
+
+  /* Not an image we can process (e.g. a slideshow) */
+  format = gdk_pixbuf_get_file_info (path, &src_width, &src_height);
+  if (!format || gdk_pixbuf_format_is_scalable (format) || !outputs || outputs->len == 0)
+    return g_steal_pointer (&result);
+
+  for (i = 0; i < outputs->len; i++) {
+    output = &g_array_index (outputs, PmpWallpaperOutput, i);
+    largest = MAX (largest, MAX (output->width, output->height));
+  }
+  /* There's only one background for all outputs, the one that covers all of them */
+  if (flags & PMP_WALLPAPER_VARIANTS_FLAG_BACKGROUND) {
+    add_variant (variants, g_strdup_printf ("%dx%d", largest, largest),
+                 VARIANT_KIND_BACKGROUND, largest, largest);
+  }
+  if (flags & PMP_WALLPAPER_VARIANTS_FLAG_LOCK_SCREEN) {
+    output = &g_array_index (outputs, PmpWallpaperOutput, 0);
+    add_variant (variants, g_strdup_printf ("lock-%dx%d", output->width, output->height),
+                 VARIANT_KIND_LOCK_SCREEN, output->width, output->height);
+  }
+  /* Dark mode uses the same geometry as the background */
+  if (flags & PMP_WALLPAPER_VARIANTS_FLAG_BACKGROUND) {
+    add_variant (variants, g_strdup_printf ("dark-%dx%d", largest, largest),
+                 VARIANT_KIND_DARK, largest, largest);
+  }
+  if (flags & PMP_WALLPAPER_VARIANTS_FLAG_BLURRED) {
+    int side = MIN (largest, BLURRED_SIZE);
+
+    add_variant (variants, g_strdup ("blurred"), VARIANT_KIND_BLURRED, side, side);
+  }
+
+  for (i = 0; i < variants->len; i++) {
+    Variant *variant = &g_array_index (variants, Variant, i);
+    double scale = get_cover_scale (src_width, src_height, variant->width, variant->height);
+
+    /* Don't blow up small images */
+    if (scale >= 1.0) {
+      if (!variant_alters_pixels (variant))
+        continue;
+      scale = 1.0;
+    }
+
+    decode_scale = MAX (decode_scale, scale);
+    variant->path = pmp_wallpaper_store_find_variant (path, variant->name, NULL);
+    if (!variant->path)
+      all_stored = FALSE;
+  }
+
+  if (decode_scale <= 0.0)
+    return g_steal_pointer (&result);
+
+  palette_path = pmp_wallpaper_store_get_variant_path (path, "palette", "ini");
+  if (!g_file_test (palette_path, G_FILE_TEST_IS_REGULAR))
+    all_stored = FALSE;
+
+  if (!all_stored) {
+    /* Let the decoder scale down (e.g. JPEG's DCT scaling) so we never hold the full image */
+    decoded = gdk_pixbuf_new_from_file_at_scale (path,
+                                                 (int) (src_width * decode_scale + 0.5),
+                                                 (int) (src_height * decode_scale + 0.5),
+                                                 TRUE,
+                                                 error);
+    if (!decoded)
+      return NULL;
+
+    pixbuf = gdk_pixbuf_apply_embedded_orientation (decoded);
+    g_clear_object (&decoded);
+  }
+
+  if (pixbuf && !g_file_test (palette_path, G_FILE_TEST_IS_REGULAR)) {
+    g_autoptr (GArray) palette = pmp_palette_extract (pixbuf, PALETTE_MAX_COLORS);
+
+    if (!pmp_palette_save (palette, palette_path, error))
+      return NULL;
+  }
+  result->palette = g_steal_pointer (&palette_path);
+
+  for (i = 0; i < variants->len; i++) {
+    Variant *variant = &g_array_index (variants, Variant, i);
+    g_autoptr (GdkPixbuf) scaled = NULL;
+
+    if (variant->path)
+      continue;
+
+    if (!variant_alters_pixels (variant) &&
+        get_cover_scale (src_width, src_height, variant->width, variant->height) >= 1.0)
+      continue;
+
+    if (g_cancellable_set_error_if_cancelled (cancellable, error))
+      return NULL;
+
+    scaled = scale_to_cover (pixbuf, variant->width, variant->height,
+                             variant->kind == VARIANT_KIND_LOCK_SCREEN);
+
+    if (variant->kind == VARIANT_KIND_DARK) {
+      GdkPixbuf *dark = create_dark (scaled);
+
+      if (!dark) {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to allocate dark variant");
+        return NULL;
+      }
+      g_object_unref (scaled);
+      scaled = dark;
+    } else if (variant->kind == VARIANT_KIND_BLURRED) {
+      int side = MAX (gdk_pixbuf_get_width (scaled), gdk_pixbuf_get_height (scaled));
+      /* Blur in place unless it's shared with the other variants */
+      GdkPixbuf *blurred = scaled == pixbuf ? gdk_pixbuf_copy (scaled) : g_object_ref (scaled);
+      gint64 start = g_get_monotonic_time ();
+
+      if (!blurred) {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to allocate blurred variant");
+        return NULL;
+      }
+      /* Keep the look independent of the variant's size */
+      pmp_blur_pixbuf (blurred, MAX (1, BLURRED_RADIUS * side / BLURRED_SIZE));
+      g_debug ("Blurred %dx%d in %" G_GINT64_FORMAT " us",
+               gdk_pixbuf_get_width (blurred), gdk_pixbuf_get_height (blurred),
+               g_get_monotonic_time () - start);
+      g_object_unref (scaled);
+      scaled = blurred;
+    }
+
+    variant->path = save_variant (scaled, path, variant->name, error);
+    if (!variant->path)
+      return NULL;
+
+    g_debug ("Created wallpaper variant %s", variant->path);
+  }
+
+  for (i = 0; i < variants->len; i++) {
+    Variant *variant = &g_array_index (variants, Variant, i);
+    char **target;
+
+    switch (variant->kind) {
+    case VARIANT_KIND_BACKGROUND:
+      target = &result->background;
+      break;
+    case VARIANT_KIND_LOCK_SCREEN:
+      target = &result->lock_screen;
+      break;
+    case VARIANT_KIND_DARK:
+      target = &result->background_dark;
+      break;
+    case VARIANT_KIND_BLURRED:
+      target = &result->blurred;
+      break;
+    default:
+      g_assert_not_reached ();
+    }
+
+    if (variant->path) {
+      g_free (*target);
+      *target = g_strdup (variant->path);
+    }
+  }
+
+  return g_steal_pointer (&result);
+}
+
+void
+pmp_wallpaper_variants_free (PmpWallpaperVariants *variants)
+{
+  g_free (variants->background);
+  g_free (variants->background_dark);
+  g_free (variants->lock_screen);
+  g_free (variants->blurred);
+  g_free (variants->palette);
+  g_free (variants);
+}
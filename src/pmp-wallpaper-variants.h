@@ -0,0 +1,68 @@
+/*
+ * Copyright © 2024 The Phosh Developers
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/**
+ * PmpWallpaperOutput:
+ * @width: The output's width in physical pixels
+ * @height: The output's height in physical pixels
+ *
+ * An output to render the wallpaper on.
+ */
+typedef struct {
+  int width;
+  int height;
+} PmpWallpaperOutput;
+
+/**
+ * PmpWallpaperVariantsFlags:
+ * @PMP_WALLPAPER_VARIANTS_FLAG_NONE: No optional variants
+ * @PMP_WALLPAPER_VARIANTS_FLAG_BLURRED: Create a blurred variant
+ * @PMP_WALLPAPER_VARIANTS_FLAG_BACKGROUND: Create the background variants
+ * @PMP_WALLPAPER_VARIANTS_FLAG_LOCK_SCREEN: Create the lock screen variant
+ *
+ * Variants to create.
+ */
+typedef enum {
+  PMP_WALLPAPER_VARIANTS_FLAG_NONE        = 0,
+  PMP_WALLPAPER_VARIANTS_FLAG_BLURRED     = (1 << 0),
+  PMP_WALLPAPER_VARIANTS_FLAG_BACKGROUND  = (1 << 1),
+  PMP_WALLPAPER_VARIANTS_FLAG_LOCK_SCREEN = (1 << 2),
+} PmpWallpaperVariantsFlags;
+
+/**
+ * PmpWallpaperVariants:
+ * @background: The image to use as background
+ * @background_dark: The image to use as background in dark mode
+ * @lock_screen: The image to use on the lock screen
+ * @blurred: (nullable): A small blurred image e.g. for the overview
+ * @palette: (nullable): The image's dominant colors, see [func@palette_load]
+ *
+ * The files to hand to the shell for a stored wallpaper.
+ */
+typedef struct {
+  char *background;
+  char *background_dark;
+  char *lock_screen;
+  char *blurred;
+  char *palette;
+} PmpWallpaperVariants;
+
+PmpWallpaperVariants *pmp_wallpaper_variants_create (const char                 *path,
+                                                     GArray                     *outputs,
+                                                     PmpWallpaperVariantsFlags   flags,
+                                                     GCancellable               *cancellable,
+                                                     GError                    **error);
+void                  pmp_wallpaper_variants_free   (PmpWallpaperVariants       *variants);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (PmpWallpaperVariants, pmp_wallpaper_variants_free)
+
+G_END_DECLS
@@ -17,35 +17,180 @@
 #include <glib/gi18n.h>
 #include <gdesktop-enums.h>
 
+#include <sys/resource.h>
+
 #include "xdg-desktop-portal-dbus.h"
 
 #include "pmp-external-win.h"
+#include "pmp-image-probe.h"
+#include "pmp-io-pool.h"
 #include "pmp-request.h"
+#include "pmp-settings.h"
+#include "pmp-texture-cache.h"
 #include "pmp-utils.h"
 #include "pmp-wallpaper-dialog.h"
+#include "pmp-wallpaper-preview.h"
+#include "pmp-wallpaper-store.h"
+#include "pmp-wallpaper-variants.h"
 #include "pmp-wallpaper.h"
 
 #define BACKGROUND_SCHEMA "org.gnome.desktop.background"
+#define SCREENSAVER_SCHEMA "org.gnome.desktop.screensaver"
+#define PORTAL_WALLPAPER_SCHEMA "mobi.phosh.portal.wallpaper"
+
+/* Used when our schema isn't installed, e.g. when running from the source tree */
+#define DEFAULT_MAX_FILE_SIZE      (100 * 1024 * 1024)
+#define DEFAULT_MAX_IMAGE_PIXELS   (64 * 1024 * 1024)
+#define DEFAULT_MAX_IMAGE_DIMENSION 16384
+#define DEFAULT_MAX_PREVIEW_MEMORY (64 * 1024 * 1024)
+
+/* Requests probing or staging at the same time, at most one per app */
+#define MAX_ACTIVE_REQUESTS 2
+/* Requests waiting for a slot, the oldest is dropped when full */
+#define MAX_QUEUED_REQUESTS 8
+
+typedef enum {
+  WALLPAPER_TARGET_BACKGROUND  = (1 << 0),
+  WALLPAPER_TARGET_LOCK_SCREEN = (1 << 1),
+} WallpaperTarget;
+
+#define WALLPAPER_TARGET_BOTH (WALLPAPER_TARGET_BACKGROUND | WALLPAPER_TARGET_LOCK_SCREEN)
+
+/* A stored wallpaper with its variants, ready to be committed to the
+ * settings. Keeps the image pinned in the store until committed or
+ * discarded. */
+typedef struct {
+  char                 *path;
+  WallpaperTarget       target;
+  PmpWallpaperVariants *variants;
+} StagedWallpaper;
 
 typedef struct {
   PmpImplWallpaper      *impl;
   GDBusMethodInvocation *invocation;
   Request               *request;
   GtkWindow             *dialog;
+  GdkFrameClock         *frame_clock;
+  gulong                 after_paint_id;
   PmpExternalWin        *external_parent;
+  WallpaperTarget        target;
+  char                  *uri;
+  char                  *app_id;
+  char                  *parent_window;
+  gboolean               show_preview;
+
+  /* Cancelled when the request is closed */
+  gulong                 cancelled_id;
+  gboolean               probing;
+
+  /* The wallpaper is staged (stored, variants created) while the user
+   * looks at the preview and committed (settings written) on apply */
+  StagedWallpaper       *staged;
+  gboolean               staging;
+  gboolean               commit_pending;
+  gboolean               committed;
+  gboolean               closed;
+
+  /* For the statistics logged when done */
+  gint64                 start_time;
+  gint64                 blocked_time;
+
+  /* Admission control, see queue_handle () */
+  gboolean               queued;
+  gboolean               active;
 
   guint                  response;
-  gchar                 *picture_uri;
 } PmpWallpaperDialogHandle;
 
+/* Prewarmed so the next request doesn't pay for template parsing and setup */
+static PmpWallpaperDialog *spare_dialog;
+static GtkWindow *fake_parent;
+static guint prewarm_id;
+static GMemoryMonitor *memory_monitor;
+
+/* Used instead of the monitors when set, see pmp_wallpaper_set_outputs () */
+static GArray *fixed_outputs;
+
+static GQueue queued_handles = G_QUEUE_INIT;
+static GQueue active_handles = G_QUEUE_INIT;
+static guint process_queue_id;
+
+typedef struct {
+  GFile           *source;
+  GArray          *outputs;
+  WallpaperTarget  target;
+} ApplyData;
+
+static void
+apply_data_free (ApplyData *data)
+{
+  g_clear_object (&data->source);
+  g_clear_pointer (&data->outputs, g_array_unref);
+  g_free (data);
+}
+
+static void
+staged_wallpaper_free (StagedWallpaper *staged)
+{
+  g_free (staged->path);
+  g_clear_pointer (&staged->variants, pmp_wallpaper_variants_free);
+  g_free (staged);
+}
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (StagedWallpaper, staged_wallpaper_free)
+
+static void
+discard_staged_thread (GTask        *task,
+                       gpointer      source_object,
+                       gpointer      task_data,
+                       GCancellable *cancellable)
+{
+  StagedWallpaper *staged = task_data;
+
+  pmp_wallpaper_store_unpin (staged->path, FALSE);
+  g_task_return_boolean (task, TRUE);
+}
+
+/* Drop a staged wallpaper that was never committed so it doesn't linger in the store */
+static void
+discard_staged (StagedWallpaper *staged)
+{
+  g_autoptr (GTask) task = NULL;
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  g_task_set_source_tag (task, discard_staged);
+  g_task_set_priority (task, G_PRIORITY_LOW);
+  g_task_set_task_data (task, staged, (GDestroyNotify) staged_wallpaper_free);
+  pmp_io_pool_run (task, discard_staged_thread);
+}
+
+static void schedule_queue (void);
+
+/* Hands the handle's slot to the next queued request */
+static void
+release_slot (PmpWallpaperDialogHandle *handle)
+{
+  if (!handle->active)
+    return;
+
+  handle->active = FALSE;
+  g_queue_remove (&active_handles, handle);
+  schedule_queue ();
+}
+
 static void
 wallpaper_dialog_handle_free (gpointer data)
 {
   PmpWallpaperDialogHandle *handle = data;
 
+  release_slot (handle);
+  if (handle->queued)
+    g_queue_remove (&queued_handles, handle);
+
   g_clear_object (&handle->external_parent);
   g_clear_object (&handle->request);
-  g_clear_pointer (&handle->picture_uri, g_free);
+  g_free (handle->uri);
+  g_free (handle->app_id);
+  g_free (handle->parent_window);
 
   g_free (handle);
 }
@@ -53,13 +198,57 @@ wallpaper_dialog_handle_free (gpointer data)
 static void
 wallpaper_dialog_handle_close (PmpWallpaperDialogHandle *handle)
 {
-  g_clear_pointer (&handle->dialog, gtk_window_destroy);
+  if (handle->dialog) {
+    gtk_window_destroy (handle->dialog);
+    /* Drop our ref too so the dialog gets disposed, cancelling its pending I/O */
+    g_clear_object (&handle->dialog);
+    pmp_texture_cache_release ();
+    pmp_settings_release_fonts ();
+  }
+
+  if (handle->frame_clock) {
+    g_clear_signal_handler (&handle->after_paint_id, handle->frame_clock);
+    g_clear_object (&handle->frame_clock);
+  }
+
+  g_clear_signal_handler (&handle->cancelled_id, handle->request->cancellable);
+  handle->closed = TRUE;
+
+  /* Freed once the pending I/O notices the cancellation */
+  if (handle->probing || handle->staging) {
+    g_cancellable_cancel (handle->request->cancellable);
+    return;
+  }
+
+  if (handle->staged && !handle->committed)
+    discard_staged (g_steal_pointer (&handle->staged));
+  g_clear_pointer (&handle->staged, staged_wallpaper_free);
+
   wallpaper_dialog_handle_free (handle);
 }
 
+static void
+log_stats (PmpWallpaperDialogHandle *handle)
+{
+  struct rusage usage;
+
+  if (getrusage (RUSAGE_SELF, &usage) != 0)
+    usage.ru_maxrss = 0;
+
+  g_debug ("Wallpaper request for '%s' done after %.1f ms, response %u, "
+           "%.1f ms on the main loop, peak RSS %ld KiB",
+           handle->uri,
+           (g_get_monotonic_time () - handle->start_time) / 1000.0,
+           handle->response,
+           handle->blocked_time / 1000.0,
+           usage.ru_maxrss);
+}
+
 static void
 send_response (PmpWallpaperDialogHandle *handle)
 {
+  log_stats (handle);
+
   if (handle->request->exported)
     request_unexport (handle->request);
 
@@ -70,76 +259,284 @@ send_response (PmpWallpaperDialogHandle *handle)
   wallpaper_dialog_handle_close (handle);
 }
 
+static void
+on_request_cancelled (GCancellable *cancellable, PmpWallpaperDialogHandle *handle)
+{
+  /* The settings are being written already, respond once that's done */
+  if (handle->committed)
+    return;
+
+  g_debug ("Request for '%s' closed", handle->uri);
+  handle->response = 2;
+  send_response (handle);
+}
+
+/* Blocks until the settings are written so only use off the main thread */
 static gboolean
-set_gsettings (gchar *schema, gchar *uri)
+set_gsettings (WallpaperTarget target, PmpWallpaperVariants *variants)
 {
-  g_autoptr (GSettings) settings = NULL;
+  g_autoptr (GSettings) background = NULL;
+  g_autoptr (GSettings) screensaver = NULL;
+  gboolean success = TRUE;
 
-  settings = g_settings_new (schema);
+  /* Each image gets its own URI so the shell notices the change. Delay
+   * the writes so each schema changes in a single commit and the shell
+   * reloads the background only once. */
+  if (target & WALLPAPER_TARGET_BACKGROUND) {
+    g_autofree gchar *uri = g_filename_to_uri (variants->background, NULL, NULL);
+    g_autofree gchar *dark_uri = g_filename_to_uri (variants->background_dark, NULL, NULL);
+
+    background = g_settings_new (BACKGROUND_SCHEMA);
+    g_settings_delay (background);
+    success = (g_settings_set_string (background, "picture-uri", uri) &&
+               g_settings_set_string (background, "picture-uri-dark", dark_uri) &&
+               g_settings_set_enum (background, "picture-options", G_DESKTOP_BACKGROUND_STYLE_ZOOM));
+  }
 
-  return (g_settings_set_string (settings, "picture-uri", uri) &&
-          g_settings_set_string (settings, "picture-uri-dark", uri) &&
-          g_settings_set_enum (settings, "picture-options", G_DESKTOP_BACKGROUND_STYLE_ZOOM));
+  if (success && (target & WALLPAPER_TARGET_LOCK_SCREEN)) {
+    g_autofree gchar *uri = g_filename_to_uri (variants->lock_screen, NULL, NULL);
+
+    screensaver = g_settings_new (SCREENSAVER_SCHEMA);
+    g_settings_delay (screensaver);
+    success = (g_settings_set_string (screensaver, "picture-uri", uri) &&
+               g_settings_set_enum (screensaver, "picture-options", G_DESKTOP_BACKGROUND_STYLE_ZOOM));
+  }
+
+  /* All or nothing */
+  if (!success) {
+    if (background)
+      g_settings_revert (background);
+    if (screensaver)
+      g_settings_revert (screensaver);
+    return FALSE;
+  }
+
+  if (background)
+    g_settings_apply (background);
+  if (screensaver)
+    g_settings_apply (screensaver);
+  g_settings_sync ();
+
+  return TRUE;
 }
 
+/* The bytes the calling thread read and wrote so far, including cached I/O */
 static void
-on_file_copy_cb (GObject      *source_object,
-                 GAsyncResult *result,
-                 gpointer      data)
+get_thread_io (guint64 *bytes_read, guint64 *bytes_written)
 {
-  PmpWallpaperDialogHandle *handle = data;
-  g_autoptr (GFile) destination = NULL;
-  GFile *picture_file = G_FILE (source_object);
-  g_autoptr (GError) error = NULL;
-  g_autofree gchar *uri = NULL;
-  gchar *contents = NULL;
-  gsize length = 0;
+  g_autofree char *contents = NULL;
+  g_auto (GStrv) lines = NULL;
+  guint i;
 
-  handle->response = 2;
+  *bytes_read = *bytes_written = 0;
 
-  uri = g_file_get_uri (picture_file);
-  if (!g_file_load_contents_finish (picture_file, result, &contents, &length, NULL, &error)) {
-    g_warning ("Failed to copy '%s': %s", uri, error->message);
+  if (!g_file_get_contents ("/proc/thread-self/io", &contents, NULL, NULL))
+    return;
 
-    goto out;
+  lines = g_strsplit (contents, "\n", -1);
+  for (i = 0; lines[i]; i++) {
+    if (g_str_has_prefix (lines[i], "rchar: "))
+      *bytes_read = g_ascii_strtoull (lines[i] + strlen ("rchar: "), NULL, 10);
+    else if (g_str_has_prefix (lines[i], "wchar: "))
+      *bytes_written = g_ascii_strtoull (lines[i] + strlen ("wchar: "), NULL, 10);
   }
+}
+
+static void
+stage_wallpaper_thread (GTask        *task,
+                        gpointer      source_object,
+                        gpointer      task_data,
+                        GCancellable *cancellable)
+{
+  ApplyData *data = task_data;
+  g_autoptr (StagedWallpaper) staged = g_new0 (StagedWallpaper, 1);
+  PmpWallpaperVariantsFlags flags = PMP_WALLPAPER_VARIANTS_FLAG_NONE;
+  guint64 read_start, written_start, read_end, written_end;
+  gint64 start = g_get_monotonic_time ();
+  GError *error = NULL;
+
+  get_thread_io (&read_start, &written_start);
 
-  destination = g_file_new_for_uri (handle->picture_uri);
-  if (!g_file_replace_contents (destination,
-                                contents,
-                                length,
-                                NULL, FALSE,
-                                G_FILE_CREATE_REPLACE_DESTINATION,
-                                NULL, NULL,
-                                &error)) {
-    g_warning ("Failed to store image as '%s': %s", handle->picture_uri, error->message);
-    goto out;
+  staged->target = data->target;
+  staged->path = pmp_wallpaper_store_add (data->source, cancellable, &error);
+  if (!staged->path) {
+    g_task_return_error (task, error);
+    return;
   }
 
-  if (set_gsettings (BACKGROUND_SCHEMA, handle->picture_uri))
-    handle->response = 0;
-  else
-    handle->response = 1;
+  /* Only create what the targets use. The blurred variant spares the
+   * shell from blurring on the lock screen and overview. It follows the
+   * background so only bother when that changes. */
+  if (data->target & WALLPAPER_TARGET_BACKGROUND)
+    flags |= PMP_WALLPAPER_VARIANTS_FLAG_BACKGROUND | PMP_WALLPAPER_VARIANTS_FLAG_BLURRED;
+  if (data->target & WALLPAPER_TARGET_LOCK_SCREEN)
+    flags |= PMP_WALLPAPER_VARIANTS_FLAG_LOCK_SCREEN;
+
+  /* All targets share a single decode */
+  staged->variants = pmp_wallpaper_variants_create (staged->path, data->outputs, flags,
+                                                    cancellable, &error);
+  if (!staged->variants) {
+    if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+      pmp_wallpaper_store_unpin (staged->path, FALSE);
+      g_task_return_error (task, error);
+      return;
+    }
+
+    g_warning ("Failed to create variants of '%s': %s", staged->path, error->message);
+    g_clear_error (&error);
+    staged->variants = g_new0 (PmpWallpaperVariants, 1);
+    staged->variants->background = g_strdup (staged->path);
+    staged->variants->background_dark = g_strdup (staged->path);
+    staged->variants->lock_screen = g_strdup (staged->path);
+  }
 
-out:
+  get_thread_io (&read_end, &written_end);
+  g_debug ("Staged '%s' in %.1f ms, read %" G_GUINT64_FORMAT " KiB, wrote %" G_GUINT64_FORMAT " KiB",
+           staged->path,
+           (g_get_monotonic_time () - start) / 1000.0,
+           (read_end - read_start) / 1024,
+           (written_end - written_start) / 1024);
+
+  g_task_return_pointer (task, g_steal_pointer (&staged), (GDestroyNotify) staged_wallpaper_free);
+}
+
+static void
+commit_wallpaper_thread (GTask        *task,
+                         gpointer      source_object,
+                         gpointer      task_data,
+                         GCancellable *cancellable)
+{
+  StagedWallpaper *staged = task_data;
+  gboolean success = set_gsettings (staged->target, staged->variants);
+
+  pmp_wallpaper_store_unpin (staged->path, success);
+  g_task_return_int (task, success ? 0 : 1);
+}
+
+static void
+on_wallpaper_committed_cb (GObject      *source_object,
+                           GAsyncResult *result,
+                           gpointer      data)
+{
+  PmpWallpaperDialogHandle *handle = data;
+
+  handle->response = g_task_propagate_int (G_TASK (result), NULL);
   send_response (handle);
 }
 
 static void
-set_wallpaper (PmpWallpaperDialogHandle *handle,
-               const gchar              *uri)
+commit_wallpaper (PmpWallpaperDialogHandle *handle)
+{
+  g_autoptr (GTask) task = NULL;
+
+  if (handle->staging) {
+    handle->commit_pending = TRUE;
+    return;
+  }
+
+  if (!handle->staged) {
+    handle->response = 2;
+    send_response (handle);
+    return;
+  }
+
+  handle->committed = TRUE;
+  task = g_task_new (NULL, NULL, on_wallpaper_committed_cb, handle);
+  g_task_set_source_tag (task, commit_wallpaper);
+  /* Owned by the handle which outlives the task */
+  g_task_set_task_data (task, handle->staged, NULL);
+  pmp_io_pool_run (task, commit_wallpaper_thread);
+}
+
+static void
+on_wallpaper_staged_cb (GObject      *source_object,
+                        GAsyncResult *result,
+                        gpointer      data)
+{
+  PmpWallpaperDialogHandle *handle = data;
+  g_autoptr (GError) error = NULL;
+
+  handle->staging = FALSE;
+  handle->staged = g_task_propagate_pointer (G_TASK (result), &error);
+
+  if (handle->closed) {
+    wallpaper_dialog_handle_close (handle);
+    return;
+  }
+
+  if (!handle->staged)
+    g_warning ("Failed to stage '%s': %s", handle->uri, error->message);
+
+  if (handle->commit_pending) {
+    commit_wallpaper (handle);
+    return;
+  }
+
+  /* Waiting for the user doesn't need a slot */
+  release_slot (handle);
+}
+
+/* The size of each monitor in physical pixels */
+static GArray *
+get_outputs (void)
+{
+  GArray *outputs;
+  GdkDisplay *display;
+  GListModel *monitors;
+  guint i;
+
+  if (fixed_outputs)
+    return g_array_copy (fixed_outputs);
+
+  outputs = g_array_new (FALSE, FALSE, sizeof (PmpWallpaperOutput));
+  display = gdk_display_get_default ();
+  if (!display)
+    return outputs;
+
+  monitors = gdk_display_get_monitors (display);
+  for (i = 0; i < g_list_model_get_n_items (monitors); i++) {
+    g_autoptr (GdkMonitor) monitor = g_list_model_get_item (monitors, i);
+    int scale = gdk_monitor_get_scale_factor (monitor);
+    PmpWallpaperOutput output;
+    GdkRectangle geometry;
+
+    gdk_monitor_get_geometry (monitor, &geometry);
+    output.width = geometry.width * scale;
+    output.height = geometry.height * scale;
+    g_array_append_val (outputs, output);
+  }
+
+  return outputs;
+}
+
+/*
+ * Stores the image and creates its variants without touching any
+ * settings yet. Hashing, copying and scaling can take long on slow
+ * storage so keep it off the main loop.
+ */
+static void
+stage_wallpaper (PmpWallpaperDialogHandle *handle, int io_priority)
 {
-  g_autoptr (GFile) source = NULL;
-  g_autofree gchar *path = NULL;
+  g_autoptr (GTask) task = NULL;
+  gint64 start = g_get_monotonic_time ();
+  ApplyData *data;
+
+  data = g_new0 (ApplyData, 1);
+  data->source = g_file_new_for_uri (handle->uri);
+  data->outputs = get_outputs ();
+  data->target = handle->target;
 
-  path = g_build_filename (g_get_user_config_dir (), "background", NULL);
-  handle->picture_uri = g_filename_to_uri (path, NULL, NULL);
+  handle->staging = TRUE;
 
-  source = g_file_new_for_uri (uri);
-  g_file_load_contents_async (source,
-                              NULL,
-                              on_file_copy_cb,
-                              handle);
+  task = g_task_new (NULL, handle->request->cancellable, on_wallpaper_staged_cb, handle);
+  g_task_set_source_tag (task, stage_wallpaper);
+  g_task_set_priority (task, io_priority);
+  /* We want the result even when cancelled so it can be discarded */
+  g_task_set_check_cancellable (task, FALSE);
+  g_task_set_task_data (task, data, (GDestroyNotify) apply_data_free);
+  pmp_io_pool_run (task, stage_wallpaper_thread);
+
+  handle->blocked_time += g_get_monotonic_time () - start;
 }
 
 static void
@@ -164,14 +561,433 @@ handle_wallpaper_dialog_response (PmpWallpaperDialog *dialog,
     break;
 
   case GTK_RESPONSE_APPLY:
-    handle->response = 0;
-    set_wallpaper (handle, pmp_wallpaper_dialog_get_uri (dialog));
+    /* Usually staged already while the user looked at the preview */
+    commit_wallpaper (handle);
     return;
   }
 
   send_response (handle);
 }
 
+static WallpaperTarget
+get_target (GVariant *options)
+{
+  const char *set_on = NULL;
+
+  if (!g_variant_lookup (options, "set-on", "&s", &set_on) || g_strcmp0 (set_on, "both") == 0)
+    return WALLPAPER_TARGET_BOTH;
+
+  if (g_strcmp0 (set_on, "background") == 0)
+    return WALLPAPER_TARGET_BACKGROUND;
+
+  if (g_strcmp0 (set_on, "lockscreen") == 0)
+    return WALLPAPER_TARGET_LOCK_SCREEN;
+
+  g_warning ("Unknown set-on value '%s', using both", set_on);
+  return WALLPAPER_TARGET_BOTH;
+}
+
+static GSettings *
+get_portal_settings (void)
+{
+  GSettingsSchemaSource *source = g_settings_schema_source_get_default ();
+  g_autoptr (GSettingsSchema) schema = NULL;
+
+  if (source)
+    schema = g_settings_schema_source_lookup (source, PORTAL_WALLPAPER_SCHEMA, TRUE);
+  if (!schema) {
+    g_debug ("%s schema not found, using defaults", PORTAL_WALLPAPER_SCHEMA);
+    return NULL;
+  }
+
+  return g_settings_new (PORTAL_WALLPAPER_SCHEMA);
+}
+
+static void
+get_limits (PmpImageLimits *limits)
+{
+  g_autoptr (GSettings) settings = get_portal_settings ();
+
+  limits->max_file_size = DEFAULT_MAX_FILE_SIZE;
+  limits->max_pixels = DEFAULT_MAX_IMAGE_PIXELS;
+  limits->max_dimension = DEFAULT_MAX_IMAGE_DIMENSION;
+
+  if (!settings)
+    return;
+
+  limits->max_file_size = g_settings_get_uint64 (settings, "max-file-size");
+  limits->max_pixels = g_settings_get_uint64 (settings, "max-image-pixels");
+  limits->max_dimension = g_settings_get_uint (settings, "max-image-dimension");
+}
+
+static guint64
+get_preview_memory (void)
+{
+  g_autoptr (GSettings) settings = get_portal_settings ();
+
+  if (!settings)
+    return DEFAULT_MAX_PREVIEW_MEMORY;
+
+  return g_settings_get_uint64 (settings, "max-preview-memory");
+}
+
+static gboolean
+has_transient_children (GtkWindow *window)
+{
+  g_autoptr (GList) toplevels = gtk_window_list_toplevels ();
+  GList *l;
+
+  for (l = toplevels; l; l = l->next) {
+    if (gtk_window_get_transient_for (l->data) == window)
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+/* The spare is rebuilt on the next request, free its memory for more important things */
+static void
+on_low_memory_warning (GMemoryMonitor             *monitor,
+                       GMemoryMonitorWarningLevel  level,
+                       gpointer                    data)
+{
+  g_clear_handle_id (&prewarm_id, g_source_remove);
+
+  if (!spare_dialog)
+    return;
+
+  g_debug ("Dropping unused wallpaper dialog, memory is low");
+
+  gtk_window_destroy (GTK_WINDOW (spare_dialog));
+  g_clear_object (&spare_dialog);
+
+  if (fake_parent && !has_transient_children (fake_parent)) {
+    gtk_window_destroy (fake_parent);
+    g_clear_object (&fake_parent);
+  }
+}
+
+static gboolean
+prewarm_dialog (gpointer data)
+{
+  gint64 start = g_get_monotonic_time ();
+
+  prewarm_id = 0;
+
+  /* Never shown, only there so dialogs aren't toplevels on their own */
+  if (!fake_parent)
+    fake_parent = g_object_ref_sink (g_object_new (GTK_TYPE_WINDOW, NULL));
+
+  if (!spare_dialog) {
+    spare_dialog = g_object_ref_sink (pmp_wallpaper_dialog_new ());
+    gtk_window_set_transient_for (GTK_WINDOW (spare_dialog), fake_parent);
+  }
+
+  g_debug ("Prewarmed wallpaper dialog in %.1f ms", (g_get_monotonic_time () - start) / 1000.0);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+schedule_prewarm (void)
+{
+  if (prewarm_id)
+    return;
+
+  prewarm_id = g_idle_add_full (G_PRIORITY_LOW, prewarm_dialog, NULL, NULL);
+  g_source_set_name_by_id (prewarm_id, "[pmp] prewarm wallpaper dialog");
+}
+
+/* Hands out the prewarmed dialog and prepares the next one when idle */
+static GtkWindow *
+take_dialog (void)
+{
+  if (!spare_dialog)
+    prewarm_dialog (NULL);
+
+  schedule_prewarm ();
+
+  return GTK_WINDOW (g_steal_pointer (&spare_dialog));
+}
+
+static void
+on_after_paint (GdkFrameClock *frame_clock, PmpWallpaperDialogHandle *handle)
+{
+  g_debug ("First frame of the wallpaper dialog %.1f ms after the request",
+           (g_get_monotonic_time () - handle->start_time) / 1000.0);
+
+  g_clear_signal_handler (&handle->after_paint_id, handle->frame_clock);
+}
+
+static void
+show_dialog (PmpWallpaperDialogHandle *handle)
+{
+  gint64 start = g_get_monotonic_time ();
+  GdkSurface *surface;
+  GtkWindow *dialog;
+
+  if (handle->parent_window) {
+    handle->external_parent = pmp_external_win_new_from_handle (handle->parent_window);
+    if (!handle->external_parent)
+      g_warning ("Failed to associate portal window with parent window %s", handle->parent_window);
+  }
+
+  /* We're about to render text */
+  pmp_settings_hold_fonts ();
+  pmp_texture_cache_hold ();
+
+  pmp_wallpaper_preview_set_memory_budget (get_preview_memory ());
+
+  dialog = take_dialog ();
+  pmp_wallpaper_dialog_set_image (PMP_WALLPAPER_DIALOG (dialog), handle->uri);
+  handle->dialog = dialog;
+
+  g_signal_connect (dialog, "response",
+                    G_CALLBACK (handle_wallpaper_dialog_response), handle);
+  gtk_widget_realize (GTK_WIDGET (dialog));
+
+  surface = gtk_native_get_surface (GTK_NATIVE (dialog));
+  if (handle->external_parent)
+    pmp_external_win_set_parent_of (handle->external_parent, surface);
+
+  handle->frame_clock = g_object_ref (gdk_surface_get_frame_clock (surface));
+  handle->after_paint_id = g_signal_connect (handle->frame_clock, "after-paint",
+                                             G_CALLBACK (on_after_paint), handle);
+
+  gtk_window_present (dialog);
+
+  handle->blocked_time += g_get_monotonic_time () - start;
+}
+
+static void
+on_image_probed_cb (GObject      *source_object,
+                    GAsyncResult *result,
+                    gpointer      data)
+{
+  PmpWallpaperDialogHandle *handle = data;
+  g_autoptr (GError) error = NULL;
+  gboolean success;
+
+  handle->probing = FALSE;
+  success = pmp_image_probe_finish (result, &error);
+
+  if (handle->closed) {
+    wallpaper_dialog_handle_close (handle);
+    return;
+  }
+
+  if (!success) {
+    g_warning ("Rejecting wallpaper '%s': %s", handle->uri, error->message);
+
+    if (handle->request->exported)
+      request_unexport (handle->request);
+
+    g_dbus_method_invocation_return_error (handle->invocation,
+                                           XDG_DESKTOP_PORTAL_ERROR,
+                                           XDG_DESKTOP_PORTAL_ERROR_INVALID_ARGUMENT,
+                                           "Invalid wallpaper: %s", error->message);
+    g_clear_signal_handler (&handle->cancelled_id, handle->request->cancellable);
+    wallpaper_dialog_handle_free (handle);
+    return;
+  }
+
+  if (!handle->show_preview) {
+    stage_wallpaper (handle, G_PRIORITY_DEFAULT);
+    commit_wallpaper (handle);
+    return;
+  }
+
+  /* Speculatively prepare everything while the user looks at the preview */
+  stage_wallpaper (handle, G_PRIORITY_LOW);
+  show_dialog (handle);
+}
+
+static void
+start_handle (PmpWallpaperDialogHandle *handle)
+{
+  g_autoptr (GFile) file = NULL;
+  PmpImageLimits limits;
+
+  g_debug ("Processing wallpaper request for '%s' from '%s'", handle->uri, handle->app_id);
+
+  /* Check the header before we copy or decode anything */
+  get_limits (&limits);
+  file = g_file_new_for_uri (handle->uri);
+  handle->probing = TRUE;
+  pmp_image_probe_async (file, &limits, G_PRIORITY_DEFAULT, handle->request->cancellable,
+                         on_image_probed_cb, handle);
+}
+
+static gboolean
+has_app_id (const char *app_id)
+{
+  return app_id && app_id[0] != '\0';
+}
+
+/* Host apps have no app id, tell them apart by their bus name */
+static gboolean
+is_same_client (PmpWallpaperDialogHandle *handle, PmpWallpaperDialogHandle *other)
+{
+  if (has_app_id (handle->app_id) || has_app_id (other->app_id))
+    return g_strcmp0 (handle->app_id, other->app_id) == 0;
+
+  return g_strcmp0 (handle->request->sender, other->request->sender) == 0;
+}
+
+static guint
+count_queued (PmpWallpaperDialogHandle *handle)
+{
+  guint n = 0;
+  GList *l;
+
+  for (l = queued_handles.head; l; l = l->next)
+    n += is_same_client (handle, l->data);
+
+  return n;
+}
+
+static gboolean
+has_active_handle (const char *app_id)
+{
+  GList *l;
+
+  /* Unrelated host apps all have an empty app id */
+  if (!has_app_id (app_id))
+    return FALSE;
+
+  for (l = active_handles.head; l; l = l->next) {
+    PmpWallpaperDialogHandle *handle = l->data;
+
+    if (g_strcmp0 (handle->app_id, app_id) == 0)
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+static void
+process_queue (void)
+{
+  GList *l, *next;
+
+  for (l = queued_handles.head; l; l = next) {
+    PmpWallpaperDialogHandle *handle = l->data;
+
+    next = l->next;
+    if (active_handles.length >= MAX_ACTIVE_REQUESTS)
+      break;
+
+    if (has_active_handle (handle->app_id))
+      continue;
+
+    g_queue_delete_link (&queued_handles, l);
+    handle->queued = FALSE;
+    g_queue_push_tail (&active_handles, handle);
+    handle->active = TRUE;
+    start_handle (handle);
+  }
+}
+
+static gboolean
+on_process_queue (gpointer data)
+{
+  process_queue_id = 0;
+  process_queue ();
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Handles get freed from within the queue walk so defer processing */
+static void
+schedule_queue (void)
+{
+  if (process_queue_id || g_queue_is_empty (&queued_handles))
+    return;
+
+  process_queue_id = g_idle_add (on_process_queue, NULL);
+  g_source_set_name_by_id (process_queue_id, "[pmp] process wallpaper queue");
+}
+
+static void
+supersede_handle (PmpWallpaperDialogHandle *handle)
+{
+  g_debug ("Wallpaper request for '%s' from '%s' superseded", handle->uri, handle->app_id);
+
+  handle->response = 2;
+  send_response (handle);
+}
+
+/*
+ * Makes room for @handle in the full queue. The client with the most
+ * requests (counting @handle) loses its oldest one so a single app
+ * can't push out the others. On a tie @handle's client loses, which
+ * can be @handle itself. Returns whether @handle can be queued.
+ */
+static gboolean
+make_room (PmpWallpaperDialogHandle *handle)
+{
+  PmpWallpaperDialogHandle *busiest = NULL, *own_oldest = NULL;
+  guint most = count_queued (handle) + 1;
+  GList *l;
+
+  for (l = queued_handles.head; l; l = l->next) {
+    PmpWallpaperDialogHandle *other = l->data;
+    guint n;
+
+    if (is_same_client (handle, other)) {
+      if (!own_oldest)
+        own_oldest = other;
+      continue;
+    }
+
+    /* Queued oldest first so this is the client's oldest request */
+    n = count_queued (other);
+    if (n > most) {
+      most = n;
+      busiest = other;
+    }
+  }
+
+  if (busiest) {
+    supersede_handle (busiest);
+  } else if (own_oldest) {
+    supersede_handle (own_oldest);
+  } else {
+    supersede_handle (handle);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/*
+ * Wallpaper rotation apps can send lots of requests in a row. Only a
+ * few are processed at a time and the latest request wins: it
+ * supersedes the app's queued requests for the same target(s). Host
+ * apps have no app id to tell them apart so they don't supersede each
+ * other.
+ */
+static void
+queue_handle (PmpWallpaperDialogHandle *handle)
+{
+  GList *l, *next;
+
+  for (l = queued_handles.head; l && has_app_id (handle->app_id); l = next) {
+    PmpWallpaperDialogHandle *other = l->data;
+
+    next = l->next;
+    if (g_strcmp0 (other->app_id, handle->app_id) == 0 && (other->target & ~handle->target) == 0)
+      supersede_handle (other);
+  }
+
+  if (queued_handles.length >= MAX_QUEUED_REQUESTS && !make_room (handle))
+    return;
+
+  g_queue_push_tail (&queued_handles, handle);
+  handle->queued = TRUE;
+  process_queue ();
+}
+
 static gboolean
 handle_set_wallpaper_uri (PmpImplWallpaper      *object,
                           GDBusMethodInvocation *invocation,
@@ -184,52 +1000,28 @@ handle_set_wallpaper_uri (PmpImplWallpaper      *object,
   g_autoptr (Request) request = NULL;
   PmpWallpaperDialogHandle *handle;
   const char *sender;
-  gboolean show_preview = FALSE;
-  PmpExternalWin *external_parent = NULL;
-  GdkSurface *surface;
-  GtkWidget *fake_parent;
-  GtkWindow *dialog;
 
   sender = g_dbus_method_invocation_get_sender (invocation);
   request = request_new (sender, arg_app_id, arg_handle);
 
-  g_variant_lookup (arg_options, "show-preview", "b", &show_preview);
-
   handle = g_new0 (PmpWallpaperDialogHandle, 1);
+  handle->start_time = g_get_monotonic_time ();
   handle->impl = object;
   handle->invocation = invocation;
   handle->request = g_object_ref (request);
+  handle->target = get_target (arg_options);
+  handle->uri = g_strdup (arg_uri);
+  handle->app_id = g_strdup (arg_app_id);
+  handle->parent_window = g_strdup (arg_parent_window);
+  g_variant_lookup (arg_options, "show-preview", "b", &handle->show_preview);
+  /* Get the dialog ready while the image gets probed */
+  if (handle->show_preview)
+    schedule_prewarm ();
+  handle->cancelled_id = g_signal_connect (request->cancellable, "cancelled",
+                                           G_CALLBACK (on_request_cancelled), handle);
 
-  if (!show_preview) {
-    set_wallpaper (handle, arg_uri);
-    goto out;
-  }
-
-  if (arg_parent_window) {
-    external_parent = pmp_external_win_new_from_handle (arg_parent_window);
-    if (!external_parent)
-      g_warning ("Failed to associate portal window with parent window %s", arg_parent_window);
-  }
-
-  fake_parent = g_object_new (GTK_TYPE_WINDOW, NULL);
-  g_object_ref_sink (fake_parent);
-
-  dialog = (GtkWindow *)pmp_wallpaper_dialog_new (arg_uri, arg_app_id);
-  gtk_window_set_transient_for (dialog, GTK_WINDOW (fake_parent));
-  handle->dialog = g_object_ref_sink (dialog);
-
-  g_signal_connect (dialog, "response",
-                    G_CALLBACK (handle_wallpaper_dialog_response), handle);
-  gtk_widget_realize (GTK_WIDGET (dialog));
-
-  surface = gtk_native_get_surface (GTK_NATIVE (dialog));
-  if (external_parent)
-    pmp_external_win_set_parent_of (external_parent, surface);
-
-  gtk_window_present (dialog);
-
-out:
   request_export (request, g_dbus_method_invocation_get_connection (invocation));
+  queue_handle (handle);
 
   return TRUE;
 }
@@ -252,5 +1044,30 @@ pmp_wallpaper_init (GDBusConnection *bus, GError **error)
 
   g_debug ("providing %s", g_dbus_interface_skeleton_get_info (helper)->name);
 
+  /* Keep a dialog ready so even the first request opens fast, unless
+   * memory gets tight. Nothing to build when running headless. */
+  if (gdk_display_get_default ()) {
+    memory_monitor = g_memory_monitor_dup_default ();
+    g_signal_connect (memory_monitor, "low-memory-warning",
+                      G_CALLBACK (on_low_memory_warning), NULL);
+    schedule_prewarm ();
+  }
+
   return TRUE;
 }
+
+/**
+ * pmp_wallpaper_set_outputs:
+ * @outputs: (nullable) (element-type PmpWallpaperOutput): The outputs
+ *
+ * Renders wallpapers for @outputs instead of the monitors, e.g. when
+ * running headless in tests and benchmarks. %NULL goes back to the
+ * monitors.
+ */
+void
+pmp_wallpaper_set_outputs (GArray *outputs)
+{
+  g_clear_pointer (&fixed_outputs, g_array_unref);
+  if (outputs)
+    fixed_outputs = g_array_ref (outputs);
+}
@@ -14,6 +14,7 @@
 
 G_BEGIN_DECLS
 
-gboolean pmp_wallpaper_init (GDBusConnection *bus, GError **error);
+gboolean pmp_wallpaper_init        (GDBusConnection *bus, GError **error);
+void     pmp_wallpaper_set_outputs (GArray          *outputs);
 
 G_END_DECLS
@@ -28,7 +28,6 @@
 #include "pmp-wallpaper.h"
 
 static GMainLoop *loop = NULL;
-static GHashTable *outstanding_handles = NULL;
 
 static gboolean opt_verbose;
 static gboolean opt_replace;
@@ -178,8 +177,6 @@ main (int argc, char *argv[])
 
   loop = g_main_loop_new (NULL, FALSE);
 
-  outstanding_handles = g_hash_table_new (g_str_hash, g_str_equal);
-
   session_bus = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, &error);
   if (session_bus == NULL) {
     g_printerr ("No session bus: %s\n", error->message);
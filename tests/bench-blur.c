@@ -0,0 +1,50 @@
+/*
+ * Copyright © 2024 The Phosh Developers
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Measures the blur used for the blurred wallpaper variant across image
+ * sizes.
+ */
+
+#include "pmp-config.h"
+
+#include "pmp-blur.h"
+
+#define BENCHMARK_RUNS   5
+#define BENCHMARK_RADIUS 8
+
+int
+main (void)
+{
+  const int sizes[] = { 256, 512, 720, 1080, 1440, 2160, 4000 };
+  gsize i;
+
+  g_print ("%-12s %10s %12s\n", "size", "ms", "Mpixel/s");
+
+  for (i = 0; i < G_N_ELEMENTS (sizes); i++) {
+    g_autoptr (GdkPixbuf) pixbuf = NULL;
+    guint8 *pixels;
+    gint64 start, elapsed;
+    gsize j, len;
+    double ms;
+    int run;
+
+    pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, FALSE, 8, sizes[i], sizes[i]);
+    pixels = gdk_pixbuf_get_pixels (pixbuf);
+    len = gdk_pixbuf_get_byte_length (pixbuf);
+    for (j = 0; j < len; j++)
+      pixels[j] = g_random_int_range (0, 256);
+
+    start = g_get_monotonic_time ();
+    for (run = 0; run < BENCHMARK_RUNS; run++)
+      pmp_blur_pixbuf (pixbuf, BENCHMARK_RADIUS);
+    elapsed = g_get_monotonic_time () - start;
+
+    ms = elapsed / 1000.0 / BENCHMARK_RUNS;
+    g_print ("%5dx%-6d %10.2f %12.1f\n", sizes[i], sizes[i], ms,
+             (double) sizes[i] * sizes[i] / (ms * 1000.0));
+  }
+
+  return 0;
+}
@@ -0,0 +1,390 @@
+/*
+ * Copyright © 2024 The Phosh Developers
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Measures how long it takes from changing font files to the monitor's
+ * "updated" signal on a generated font tree. The tree and its
+ * configuration live in a temporary directory so the user's fonts and
+ * font caches aren't touched.
+ */
+
+#include "pmp-config.h"
+
+#include "fc-monitor.h"
+
+#include <glib/gstdio.h>
+
+/* Give up if an update doesn't arrive within that time */
+#define BENCH_TIMEOUT_SECONDS 30
+
+/* A single glyph bitmap font, BDF is text so we don't need any fixture files */
+#define BENCH_BDF_FONT                                                  \
+  "STARTFONT 2.1\n"                                                     \
+  "FONT -pmp-%s-medium-r-normal--8-80-75-75-c-80-iso10646-1\n"          \
+  "SIZE 8 75 75\n"                                                      \
+  "FONTBOUNDINGBOX 8 8 0 0\n"                                           \
+  "STARTPROPERTIES 3\n"                                                 \
+  "FAMILY_NAME \"%s\"\n"                                                \
+  "FONT_ASCENT 8\n"                                                     \
+  "FONT_DESCENT 0\n"                                                    \
+  "ENDPROPERTIES\n"                                                     \
+  "CHARS 1\n"                                                           \
+  "STARTCHAR A\n"                                                       \
+  "ENCODING 65\n"                                                       \
+  "SWIDTH 500 0\n"                                                      \
+  "DWIDTH 8 0\n"                                                        \
+  "BBX 8 8 0 0\n"                                                       \
+  "BITMAP\n"                                                            \
+  "18\n24\n42\n42\n7E\n42\n42\n00\n"                                    \
+  "ENDCHAR\n"                                                           \
+  "ENDFONT\n"
+
+static int opt_dirs = 8;
+static int opt_fonts = 16;
+static int opt_burst = 32;
+static int opt_runs = 5;
+
+static GOptionEntry entries[] = {
+  { "dirs", 'd', 0, G_OPTION_ARG_INT, &opt_dirs, "Number of font directories", "N" },
+  { "fonts", 'f', 0, G_OPTION_ARG_INT, &opt_fonts, "Number of fonts per directory", "M" },
+  { "burst", 'b', 0, G_OPTION_ARG_INT, &opt_burst, "Number of fonts added in a burst", "N" },
+  { "runs", 'r', 0, G_OPTION_ARG_INT, &opt_runs, "Number of runs per operation", "N" },
+  { NULL }
+};
+
+typedef struct {
+  char      *root;
+  FcMonitor *monitor;
+  gboolean   updated;
+  gint64     updated_time;
+  gboolean   timed_out;
+} Fixture;
+
+typedef struct {
+  const char *name;
+  GArray     *latency;
+  GArray     *scan_time;
+  GArray     *reinit_time;
+} Stats;
+
+static char *
+get_dir (Fixture *fixture, int dir)
+{
+  return g_strdup_printf ("%s/fonts/%d", fixture->root, dir);
+}
+
+static char *
+get_font (Fixture *fixture, int dir, const char *family)
+{
+  g_autofree char *path = get_dir (fixture, dir);
+
+  return g_strdup_printf ("%s/%s.bdf", path, family);
+}
+
+static void
+write_font (Fixture *fixture, int dir, const char *family)
+{
+  g_autoptr (GError) error = NULL;
+  g_autofree char *path = get_font (fixture, dir, family);
+  g_autofree char *contents = g_strdup_printf (BENCH_BDF_FONT, family, family);
+
+  if (!g_file_set_contents (path, contents, -1, &error))
+    g_error ("Failed to write %s: %s", path, error->message);
+}
+
+static void
+remove_font (Fixture *fixture, int dir, const char *family)
+{
+  g_autofree char *path = get_font (fixture, dir, family);
+
+  if (g_unlink (path) != 0)
+    g_error ("Failed to remove %s", path);
+}
+
+static void
+setup_tree (Fixture *fixture)
+{
+  g_autoptr (GString) config = g_string_new (NULL);
+  g_autoptr (GError) error = NULL;
+  g_autofree char *config_path = NULL;
+  int i, j;
+
+  fixture->root = g_dir_make_tmp ("pmp-bench-fc-XXXXXX", &error);
+  if (!fixture->root)
+    g_error ("Failed to create font tree: %s", error->message);
+
+  g_string_append (config,
+                   "<?xml version=\"1.0\"?>\n"
+                   "<!DOCTYPE fontconfig SYSTEM \"urn:fontconfig:fonts.dtd\">\n"
+                   "<fontconfig>\n");
+
+  for (i = 0; i < opt_dirs; i++) {
+    g_autofree char *dir = get_dir (fixture, i);
+    g_autofree char *escaped = g_markup_escape_text (dir, -1);
+
+    if (g_mkdir_with_parents (dir, 0755) != 0)
+      g_error ("Failed to create %s", dir);
+    g_string_append_printf (config, "  <dir>%s</dir>\n", escaped);
+
+    for (j = 0; j < opt_fonts; j++) {
+      g_autofree char *family = g_strdup_printf ("PmpBench%dx%d", i, j);
+
+      write_font (fixture, i, family);
+    }
+  }
+
+  g_string_append_printf (config, "  <cachedir>%s/cache</cachedir>\n</fontconfig>\n",
+                          fixture->root);
+
+  config_path = g_build_filename (fixture->root, "fonts.conf", NULL);
+  if (!g_file_set_contents (config_path, config->str, config->len, &error))
+    g_error ("Failed to write %s: %s", config_path, error->message);
+
+  /* Must happen before fontconfig gets initialized */
+  g_setenv ("FONTCONFIG_FILE", config_path, TRUE);
+}
+
+static gboolean
+remove_tree (const char *path)
+{
+  g_autoptr (GDir) dir = g_dir_open (path, 0, NULL);
+  const char *name;
+
+  while (dir && (name = g_dir_read_name (dir))) {
+    g_autofree char *child = g_build_filename (path, name, NULL);
+
+    if (g_file_test (child, G_FILE_TEST_IS_DIR) && !g_file_test (child, G_FILE_TEST_IS_SYMLINK))
+      remove_tree (child);
+    else
+      g_unlink (child);
+  }
+
+  return g_rmdir (path) == 0;
+}
+
+static gboolean
+on_timeout (gpointer data)
+{
+  Fixture *fixture = data;
+
+  fixture->timed_out = TRUE;
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+on_updated (Fixture *fixture)
+{
+  fixture->updated = TRUE;
+  fixture->updated_time = g_get_monotonic_time ();
+}
+
+static gboolean
+is_updated (Fixture *fixture)
+{
+  return fixture->updated;
+}
+
+static gboolean
+is_watching (Fixture *fixture)
+{
+  return fc_monitor_get_n_watches (fixture->monitor) > 0;
+}
+
+static void
+wait_for (Fixture *fixture, gboolean (*done) (Fixture *), const char *what)
+{
+  guint timeout_id;
+
+  fixture->timed_out = FALSE;
+  timeout_id = g_timeout_add_seconds (BENCH_TIMEOUT_SECONDS, on_timeout, fixture);
+
+  while (!done (fixture) && !fixture->timed_out)
+    g_main_context_iteration (NULL, TRUE);
+
+  if (fixture->timed_out)
+    g_error ("Timed out waiting for %s", what);
+
+  g_source_remove (timeout_id);
+}
+
+static void
+stats_init (Stats *stats, const char *name)
+{
+  stats->name = name;
+  stats->latency = g_array_new (FALSE, FALSE, sizeof (gint64));
+  stats->scan_time = g_array_new (FALSE, FALSE, sizeof (gint64));
+  stats->reinit_time = g_array_new (FALSE, FALSE, sizeof (gint64));
+}
+
+static void
+stats_clear (Stats *stats)
+{
+  g_clear_pointer (&stats->latency, g_array_unref);
+  g_clear_pointer (&stats->scan_time, g_array_unref);
+  g_clear_pointer (&stats->reinit_time, g_array_unref);
+}
+
+static int
+compare_times (gconstpointer a, gconstpointer b)
+{
+  gint64 time_a = *(const gint64 *) a;
+  gint64 time_b = *(const gint64 *) b;
+
+  return time_a < time_b ? -1 : time_a > time_b;
+}
+
+/* Expects @times to be sorted */
+static double
+get_median (GArray *times)
+{
+  return g_array_index (times, gint64, times->len / 2) / 1000.0;
+}
+
+static void
+stats_print (Stats *stats)
+{
+  g_array_sort (stats->latency, compare_times);
+  g_array_sort (stats->scan_time, compare_times);
+  g_array_sort (stats->reinit_time, compare_times);
+
+  g_print ("%-8s %12.1f %12.1f %12.1f %12.1f %12.1f\n",
+           stats->name,
+           get_median (stats->latency),
+           g_array_index (stats->latency, gint64, 0) / 1000.0,
+           g_array_index (stats->latency, gint64, stats->latency->len - 1) / 1000.0,
+           get_median (stats->scan_time),
+           get_median (stats->reinit_time));
+}
+
+/* Waits for the update caused by a change started at @start and records its cost */
+static void
+record_update (Fixture *fixture, Stats *stats, gint64 start, const char *family, gboolean added)
+{
+  const char * const *families;
+  gint64 latency, scan_time, reinit_time;
+
+  wait_for (fixture, is_updated, "the font update");
+
+  families = added ? fc_monitor_get_added_families (fixture->monitor) :
+    fc_monitor_get_removed_families (fixture->monitor);
+  if (!families || !g_strv_contains (families, family))
+    g_error ("Update didn't report %s as %s", family, added ? "added" : "removed");
+
+  fc_monitor_get_update_times (fixture->monitor, &scan_time, &reinit_time);
+  latency = fixture->updated_time - start;
+  g_array_append_val (stats->latency, latency);
+  g_array_append_val (stats->scan_time, scan_time);
+  g_array_append_val (stats->reinit_time, reinit_time);
+}
+
+static void
+run_single (Fixture *fixture, Stats *add, Stats *removal, int run)
+{
+  g_autofree char *family = g_strdup_printf ("PmpBenchAdded%d", run);
+  int dir = run % opt_dirs;
+  gint64 start;
+
+  fixture->updated = FALSE;
+  start = g_get_monotonic_time ();
+  write_font (fixture, dir, family);
+  record_update (fixture, add, start, family, TRUE);
+
+  fixture->updated = FALSE;
+  start = g_get_monotonic_time ();
+  remove_font (fixture, dir, family);
+  record_update (fixture, removal, start, family, FALSE);
+}
+
+/* Changes fonts all over the tree at once, these should get coalesced into one update */
+static void
+run_burst (Fixture *fixture, Stats *burst, int run)
+{
+  g_autofree char *last = NULL;
+  gint64 start;
+  int i;
+
+  fixture->updated = FALSE;
+  start = g_get_monotonic_time ();
+  for (i = 0; i < opt_burst; i++) {
+    g_free (last);
+    last = g_strdup_printf ("PmpBenchBurst%dx%d", run, i);
+    write_font (fixture, i % opt_dirs, last);
+  }
+  record_update (fixture, burst, start, last, TRUE);
+
+  fixture->updated = FALSE;
+  for (i = 0; i < opt_burst; i++) {
+    g_autofree char *family = g_strdup_printf ("PmpBenchBurst%dx%d", run, i);
+
+    remove_font (fixture, i % opt_dirs, family);
+  }
+  wait_for (fixture, is_updated, "the burst removal");
+}
+
+int
+main (int argc, char **argv)
+{
+  g_autoptr (GOptionContext) context = g_option_context_new ("- fontconfig monitor benchmark");
+  g_autoptr (GError) error = NULL;
+  Fixture fixture = { 0 };
+  Stats add, removal, burst;
+  gint64 start;
+  int run;
+
+  g_option_context_add_main_entries (context, entries, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error)) {
+    g_printerr ("%s\n", error->message);
+    return 1;
+  }
+  opt_dirs = MAX (opt_dirs, 1);
+  opt_burst = MAX (opt_burst, 1);
+  opt_runs = MAX (opt_runs, 1);
+
+  setup_tree (&fixture);
+
+  fixture.monitor = fc_monitor_new ();
+  g_signal_connect_swapped (fixture.monitor, "updated", G_CALLBACK (on_updated), &fixture);
+  /* Measure the reinitialization too as done while the wallpaper dialog is up */
+  fc_monitor_set_load_fonts (fixture.monitor, TRUE);
+
+  start = g_get_monotonic_time ();
+  fc_monitor_start (fixture.monitor);
+  wait_for (&fixture, is_watching, "the initial scan");
+
+  g_print ("%d directories, %d fonts each, %u watches, initial scan %.1f ms\n\n",
+           opt_dirs, opt_fonts, fc_monitor_get_n_watches (fixture.monitor),
+           (g_get_monotonic_time () - start) / 1000.0);
+
+  stats_init (&add, "add");
+  stats_init (&removal, "remove");
+  stats_init (&burst, "burst");
+
+  for (run = 0; run < opt_runs; run++) {
+    run_single (&fixture, &add, &removal, run);
+    run_burst (&fixture, &burst, run);
+  }
+
+  /* Latency includes the monitor's debounce timeout */
+  g_print ("%-8s %12s %12s %12s %12s %12s\n",
+           "op", "median ms", "min ms", "max ms", "scan ms", "reinit ms");
+  stats_print (&add);
+  stats_print (&removal);
+  stats_print (&burst);
+  g_print ("\n%u watches\n", fc_monitor_get_n_watches (fixture.monitor));
+
+  stats_clear (&add);
+  stats_clear (&removal);
+  stats_clear (&burst);
+
+  fc_monitor_stop (fixture.monitor);
+  fc_monitor_set_load_fonts (fixture.monitor, FALSE);
+  g_clear_object (&fixture.monitor);
+
+  if (!remove_tree (fixture.root))
+    g_warning ("Failed to remove %s", fixture.root);
+  g_free (fixture.root);
+
+  return 0;
+}
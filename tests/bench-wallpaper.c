@@ -0,0 +1,516 @@
+/*
+ * Copyright © 2024 The Phosh Developers
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Measures the wallpaper portal's apply path end to end: a client sends
+ * SetWallpaperURI over a private session bus and waits for the
+ * response while the portal probes, stores and scales the image and
+ * writes the settings. The variant generation (scaling, dark, blur and
+ * palette) is also measured on its own. Runs headless with the memory
+ * GSettings backend and synthetic outputs, the store and caches live in
+ * a temporary directory.
+ */
+
+#include "pmp-config.h"
+
+#include "pmp-utils.h"
+#include "pmp-wallpaper-store.h"
+#include "pmp-wallpaper-variants.h"
+#include "pmp-wallpaper.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include <glib/gstdio.h>
+
+#define BENCH_APP_ID          "mobi.phosh.BenchWallpaper"
+#define BENCH_WALLPAPER_IFACE "org.freedesktop.impl.portal.Wallpaper"
+/* Give up if a request doesn't finish within that time */
+#define BENCH_TIMEOUT_MS      (120 * 1000)
+/* Interval of the main loop ticks used to measure blocking */
+#define TICK_INTERVAL_MS      5
+/* Let the largest images through the portal's limits */
+#define BENCH_MAX_PIXELS      (128 * 1024 * 1024)
+#define BENCH_MAX_FILE_SIZE   (1024 * 1024 * 1024)
+
+/* Seeds of the images for the variants runs, distinct from the apply runs */
+#define VARIANTS_SEED         1000
+
+static char *opt_sizes = NULL;
+static char *opt_outputs = NULL;
+static int opt_runs = 1;
+
+static GOptionEntry entries[] = {
+  { "sizes", 's', 0, G_OPTION_ARG_STRING, &opt_sizes, "Comma separated image sizes in megapixels", "MP,..." },
+  { "outputs", 'o', 0, G_OPTION_ARG_STRING, &opt_outputs, "Comma separated output sizes", "WxH,..." },
+  { "runs", 'r', 0, G_OPTION_ARG_INT, &opt_runs, "Number of runs per format and size", "N" },
+  { NULL }
+};
+
+typedef struct {
+  char            *root;
+  GTestDBus       *bus;
+  GDBusConnection *portal;
+  GDBusConnection *client;
+  GArray          *outputs;
+  guint            n_requests;
+} Fixture;
+
+typedef struct {
+  gint64   last_tick;
+  gint64   max_gap;
+  gint64   blocked;
+} Ticker;
+
+typedef struct {
+  gboolean done;
+  guint    response;
+  GError  *error;
+} Reply;
+
+static gboolean
+remove_tree (const char *path)
+{
+  g_autoptr (GDir) dir = g_dir_open (path, 0, NULL);
+  const char *name;
+
+  while (dir && (name = g_dir_read_name (dir))) {
+    g_autofree char *child = g_build_filename (path, name, NULL);
+
+    if (g_file_test (child, G_FILE_TEST_IS_DIR) && !g_file_test (child, G_FILE_TEST_IS_SYMLINK))
+      remove_tree (child);
+    else
+      g_unlink (child);
+  }
+
+  return g_rmdir (path) == 0;
+}
+
+/* Everything the process read and wrote so far, including cached I/O */
+static void
+get_io (guint64 *bytes_read, guint64 *bytes_written)
+{
+  g_autofree char *contents = NULL;
+  g_auto (GStrv) lines = NULL;
+  guint i;
+
+  *bytes_read = *bytes_written = 0;
+
+  if (!g_file_get_contents ("/proc/self/io", &contents, NULL, NULL))
+    return;
+
+  lines = g_strsplit (contents, "\n", -1);
+  for (i = 0; lines[i]; i++) {
+    if (g_str_has_prefix (lines[i], "rchar: "))
+      *bytes_read = g_ascii_strtoull (lines[i] + strlen ("rchar: "), NULL, 10);
+    else if (g_str_has_prefix (lines[i], "wchar: "))
+      *bytes_written = g_ascii_strtoull (lines[i] + strlen ("wchar: "), NULL, 10);
+  }
+}
+
+/* Resets the peak RSS so creating the input images doesn't count */
+static void
+reset_peak_rss (void)
+{
+  FILE *clear_refs = g_fopen ("/proc/self/clear_refs", "w");
+
+  if (!clear_refs)
+    return;
+
+  fputs ("5", clear_refs);
+  fclose (clear_refs);
+}
+
+static guint64
+get_peak_rss (void)
+{
+  g_autofree char *contents = NULL;
+  const char *hwm;
+
+  if (!g_file_get_contents ("/proc/self/status", &contents, NULL, NULL))
+    return 0;
+
+  hwm = strstr (contents, "VmHWM:");
+  if (!hwm)
+    return 0;
+
+  /* In KiB */
+  return g_ascii_strtoull (hwm + strlen ("VmHWM:"), NULL, 10) * 1024;
+}
+
+static gboolean
+on_tick (gpointer data)
+{
+  Ticker *ticker = data;
+  gint64 now = g_get_monotonic_time ();
+
+  if (ticker->last_tick) {
+    gint64 gap = now - ticker->last_tick;
+
+    ticker->max_gap = MAX (ticker->max_gap, gap);
+    if (gap > TICK_INTERVAL_MS * 1000)
+      ticker->blocked += gap - TICK_INTERVAL_MS * 1000;
+  }
+  ticker->last_tick = now;
+
+  return G_SOURCE_CONTINUE;
+}
+
+/* A gradient that differs per @seed so each run really stores a new image */
+static char *
+create_image (Fixture *fixture, const char *format, int megapixels, int seed)
+{
+  g_autoptr (GdkPixbuf) pixbuf = NULL;
+  g_autoptr (GError) error = NULL;
+  g_autofree char *name = NULL;
+  char *path;
+  guchar *pixels;
+  int width, height, rowstride, x, y;
+  gboolean success;
+
+  /* 4:3 like most camera images */
+  width = (int) sqrt (megapixels * 1000000.0 * 4 / 3);
+  height = width * 3 / 4;
+
+  pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, FALSE, 8, width, height);
+  if (!pixbuf)
+    g_error ("Failed to allocate %dx%d image", width, height);
+
+  pixels = gdk_pixbuf_get_pixels (pixbuf);
+  rowstride = gdk_pixbuf_get_rowstride (pixbuf);
+  for (y = 0; y < height; y++) {
+    guchar *p = pixels + (gsize) y * rowstride;
+
+    for (x = 0; x < width; x++, p += 3) {
+      p[0] = x * 255 / width;
+      p[1] = y * 255 / height;
+      p[2] = (x + y + seed * 37) & 0xff;
+    }
+  }
+
+  name = g_strdup_printf ("input-%dmp-%d.%s", megapixels, seed, format);
+  path = g_build_filename (fixture->root, name, NULL);
+  if (g_str_equal (format, "png"))
+    success = gdk_pixbuf_save (pixbuf, path, "png", &error, "compression", "1", NULL);
+  else
+    success = gdk_pixbuf_save (pixbuf, path, "jpeg", &error, "quality", "90", NULL);
+
+  if (!success)
+    g_error ("Failed to save %s: %s", path, error->message);
+
+  return path;
+}
+
+static void
+on_set_wallpaper_done (GObject *source_object, GAsyncResult *result, gpointer user_data)
+{
+  Reply *reply = user_data;
+  g_autoptr (GVariant) ret = NULL;
+
+  ret = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source_object), result, &reply->error);
+  if (ret)
+    g_variant_get (ret, "(u)", &reply->response);
+  reply->done = TRUE;
+}
+
+static void
+run_request (Fixture *fixture, const char *format, int megapixels, int seed)
+{
+  g_autofree char *path = create_image (fixture, format, megapixels, seed);
+  g_autofree char *uri = g_filename_to_uri (path, NULL, NULL);
+  g_autofree char *handle = NULL;
+  g_autofree char *picture_uri = NULL;
+  g_autoptr (GSettings) background = NULL;
+  GVariantBuilder options;
+  Ticker ticker = { 0 };
+  Reply reply = { 0 };
+  guint64 read_start, written_start, read_end, written_end;
+  gint64 start, latency;
+  GStatBuf st;
+  guint tick_id;
+
+  if (g_stat (path, &st) != 0)
+    g_error ("Failed to stat %s: %s", path, g_strerror (errno));
+
+  handle = g_strdup_printf ("/org/freedesktop/portal/desktop/request/bench/%u",
+                            ++fixture->n_requests);
+
+  g_variant_builder_init (&options, G_VARIANT_TYPE_VARDICT);
+  g_variant_builder_add (&options, "{sv}", "show-preview", g_variant_new_boolean (FALSE));
+  g_variant_builder_add (&options, "{sv}", "set-on", g_variant_new_string ("both"));
+
+  reset_peak_rss ();
+  get_io (&read_start, &written_start);
+  tick_id = g_timeout_add (TICK_INTERVAL_MS, on_tick, &ticker);
+  start = g_get_monotonic_time ();
+
+  g_dbus_connection_call (fixture->client,
+                          g_dbus_connection_get_unique_name (fixture->portal),
+                          DESKTOP_PORTAL_OBJECT_PATH,
+                          BENCH_WALLPAPER_IFACE,
+                          "SetWallpaperURI",
+                          g_variant_new ("(ssssa{sv})", handle, BENCH_APP_ID, "", uri, &options),
+                          G_VARIANT_TYPE ("(u)"),
+                          G_DBUS_CALL_FLAGS_NONE,
+                          BENCH_TIMEOUT_MS,
+                          NULL,
+                          on_set_wallpaper_done,
+                          &reply);
+
+  while (!reply.done)
+    g_main_context_iteration (NULL, TRUE);
+
+  latency = g_get_monotonic_time () - start;
+  g_source_remove (tick_id);
+  get_io (&read_end, &written_end);
+
+  if (reply.error)
+    g_error ("Setting %s failed: %s", path, reply.error->message);
+  if (reply.response != 0)
+    g_error ("Setting %s failed with response %u", path, reply.response);
+
+  /* The settings point into the store now */
+  background = g_settings_new ("org.gnome.desktop.background");
+  picture_uri = g_settings_get_string (background, "picture-uri");
+  if (g_str_equal (picture_uri, uri))
+    g_error ("Background still points to %s", uri);
+
+  g_print ("%-6s %6d %10.1f %12.1f %10.1f %10.1f %10.1f %12.1f %12.1f\n",
+           format,
+           megapixels,
+           st.st_size / (1024.0 * 1024.0),
+           latency / 1000.0,
+           get_peak_rss () / (1024.0 * 1024.0),
+           (read_end - read_start) / (1024.0 * 1024.0),
+           (written_end - written_start) / (1024.0 * 1024.0),
+           ticker.blocked / 1000.0,
+           ticker.max_gap / 1000.0);
+
+  g_unlink (path);
+}
+
+/* Creates the variants of a freshly stored image like the apply does */
+static void
+run_variants (Fixture *fixture, const char *format, int megapixels, int seed)
+{
+  g_autofree char *path = create_image (fixture, format, megapixels, seed);
+  g_autoptr (GFile) source = g_file_new_for_path (path);
+  g_autoptr (GError) error = NULL;
+  g_autoptr (PmpWallpaperVariants) variants = NULL;
+  g_autofree char *stored = NULL;
+  guint64 read_start, written_start, read_end, written_end;
+  gint64 start, latency;
+
+  stored = pmp_wallpaper_store_add (source, NULL, &error);
+  if (!stored)
+    g_error ("Failed to store %s: %s", path, error->message);
+
+  reset_peak_rss ();
+  get_io (&read_start, &written_start);
+  start = g_get_monotonic_time ();
+
+  variants = pmp_wallpaper_variants_create (stored,
+                                            fixture->outputs,
+                                            PMP_WALLPAPER_VARIANTS_FLAG_BACKGROUND |
+                                            PMP_WALLPAPER_VARIANTS_FLAG_LOCK_SCREEN |
+                                            PMP_WALLPAPER_VARIANTS_FLAG_BLURRED,
+                                            NULL,
+                                            &error);
+  latency = g_get_monotonic_time () - start;
+  get_io (&read_end, &written_end);
+
+  if (!variants)
+    g_error ("Failed to create variants of %s: %s", stored, error->message);
+  /* Make sure the work we measured really happened */
+  if (!variants->blurred || !variants->palette)
+    g_error ("Variants of %s are missing", stored);
+
+  g_print ("%-6s %6d %12.1f %10.1f %10.1f %10.1f\n",
+           format,
+           megapixels,
+           latency / 1000.0,
+           get_peak_rss () / (1024.0 * 1024.0),
+           (read_end - read_start) / (1024.0 * 1024.0),
+           (written_end - written_start) / (1024.0 * 1024.0));
+
+  pmp_wallpaper_store_unpin (stored, FALSE);
+  g_unlink (path);
+}
+
+static GArray *
+parse_outputs (const char *spec)
+{
+  g_auto (GStrv) sizes = g_strsplit (spec, ",", -1);
+  GArray *outputs = g_array_new (FALSE, FALSE, sizeof (PmpWallpaperOutput));
+  guint i;
+
+  for (i = 0; sizes[i]; i++) {
+    PmpWallpaperOutput output;
+
+    if (sscanf (sizes[i], "%dx%d", &output.width, &output.height) != 2 ||
+        output.width <= 0 || output.height <= 0)
+      g_error ("Invalid output size '%s'", sizes[i]);
+
+    g_array_append_val (outputs, output);
+  }
+
+  return outputs;
+}
+
+/* The defaults reject the largest benchmark images */
+static void
+raise_limits (void)
+{
+  GSettingsSchemaSource *source = g_settings_schema_source_get_default ();
+  g_autoptr (GSettingsSchema) schema = NULL;
+  g_autoptr (GSettings) settings = NULL;
+
+  if (source)
+    schema = g_settings_schema_source_lookup (source, "mobi.phosh.portal.wallpaper", TRUE);
+  if (!schema) {
+    g_printerr ("Portal schema not found, images over the default limits get rejected\n");
+    return;
+  }
+
+  settings = g_settings_new_full (schema, NULL, NULL);
+  g_settings_set_uint64 (settings, "max-image-pixels", BENCH_MAX_PIXELS);
+  g_settings_set_uint64 (settings, "max-file-size", BENCH_MAX_FILE_SIZE);
+}
+
+static GDBusConnection *
+connect_bus (Fixture *fixture)
+{
+  g_autoptr (GError) error = NULL;
+  GDBusConnection *connection;
+
+  connection = g_dbus_connection_new_for_address_sync (g_test_dbus_get_bus_address (fixture->bus),
+                                                       G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+                                                       G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+                                                       NULL,
+                                                       NULL,
+                                                       &error);
+  if (!connection)
+    g_error ("Failed to connect to the test bus: %s", error->message);
+
+  return connection;
+}
+
+static void
+setup (Fixture *fixture)
+{
+  g_autoptr (GError) error = NULL;
+  g_autofree char *data_dir = NULL;
+  g_autofree char *cache_dir = NULL;
+
+  fixture->root = g_dir_make_tmp ("pmp-bench-wallpaper-XXXXXX", &error);
+  if (!fixture->root)
+    g_error ("Failed to create temporary directory: %s", error->message);
+
+  /* Keep the store and thumbnails away from the user's */
+  data_dir = g_build_filename (fixture->root, "data", NULL);
+  cache_dir = g_build_filename (fixture->root, "cache", NULL);
+  g_setenv ("XDG_DATA_HOME", data_dir, TRUE);
+  g_setenv ("XDG_CACHE_HOME", cache_dir, TRUE);
+  g_setenv ("GSETTINGS_BACKEND", "memory", TRUE);
+
+  fixture->bus = g_test_dbus_new (G_TEST_DBUS_NONE);
+  g_test_dbus_up (fixture->bus);
+
+  /* Separate connections so requests come from another sender like in a
+   * session. Not the shared one as the portal keeps it referenced. */
+  fixture->portal = connect_bus (fixture);
+  fixture->client = connect_bus (fixture);
+
+  if (!pmp_wallpaper_init (fixture->portal, &error))
+    g_error ("Failed to set up the wallpaper portal: %s", error->message);
+  /* There are no monitors when headless */
+  pmp_wallpaper_set_outputs (fixture->outputs);
+
+  raise_limits ();
+}
+
+static void
+teardown (Fixture *fixture)
+{
+  g_dbus_connection_close_sync (fixture->client, NULL, NULL);
+  g_clear_object (&fixture->client);
+  g_dbus_connection_close_sync (fixture->portal, NULL, NULL);
+  g_clear_object (&fixture->portal);
+
+  g_test_dbus_down (fixture->bus);
+  g_clear_object (&fixture->bus);
+
+  pmp_wallpaper_set_outputs (NULL);
+  g_clear_pointer (&fixture->outputs, g_array_unref);
+
+  if (!remove_tree (fixture->root))
+    g_warning ("Failed to remove %s", fixture->root);
+  g_free (fixture->root);
+}
+
+int
+main (int argc, char **argv)
+{
+  g_autoptr (GOptionContext) context = g_option_context_new ("- wallpaper portal benchmark");
+  g_autoptr (GError) error = NULL;
+  const char *formats[] = { "jpeg", "png" };
+  g_auto (GStrv) sizes = NULL;
+  Fixture fixture = { 0 };
+  guint i, j;
+  int run;
+
+  g_option_context_add_main_entries (context, entries, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error)) {
+    g_printerr ("%s\n", error->message);
+    return 1;
+  }
+  opt_runs = MAX (opt_runs, 1);
+  sizes = g_strsplit (opt_sizes ?: "1,4,16,64,100", ",", -1);
+  /* A phone and an external monitor */
+  fixture.outputs = parse_outputs (opt_outputs ?: "720x1440,1920x1080");
+
+  setup (&fixture);
+
+  /* Latency is from sending the request to its response, blocked time
+   * is how much the main loop ticks got delayed meanwhile */
+  g_print ("%-6s %6s %10s %12s %10s %10s %10s %12s %12s\n",
+           "format", "MP", "file MiB", "latency ms", "RSS MiB", "read MiB", "wrote MiB",
+           "blocked ms", "max gap ms");
+
+  for (i = 0; i < G_N_ELEMENTS (formats); i++) {
+    for (j = 0; sizes[j]; j++) {
+      int megapixels = atoi (sizes[j]);
+
+      if (megapixels <= 0)
+        continue;
+
+      for (run = 0; run < opt_runs; run++)
+        run_request (&fixture, formats[i], megapixels, run);
+    }
+  }
+
+  g_print ("\nVariants for %u outputs\n", fixture.outputs->len);
+  g_print ("%-6s %6s %12s %10s %10s %10s\n",
+           "format", "MP", "latency ms", "RSS MiB", "read MiB", "wrote MiB");
+
+  for (i = 0; i < G_N_ELEMENTS (formats); i++) {
+    for (j = 0; sizes[j]; j++) {
+      int megapixels = atoi (sizes[j]);
+
+      if (megapixels <= 0)
+        continue;
+
+      for (run = 0; run < opt_runs; run++)
+        run_variants (&fixture, formats[i], megapixels, VARIANTS_SEED + run);
+    }
+  }
+
+  teardown (&fixture);
+
+  return 0;
+}
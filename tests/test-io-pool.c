@@ -0,0 +1,250 @@
+/*
+ * Copyright © 2024 The Phosh Developers
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "pmp-config.h"
+
+#include "pmp-file-copy.h"
+#include "pmp-io-pool.h"
+
+#include <string.h>
+#include <sys/stat.h>
+#include <glib/gstdio.h>
+
+/* More jobs than the pool has threads */
+#define N_BLOCKING_JOBS    4
+/* Interval of the main loop ticks and the largest gap we accept between them */
+#define TICK_INTERVAL_MS   10
+#define MAX_TICK_GAP_MS    250
+#define SLOW_CHUNK_SIZE    (64 * 1024)
+#define SLOW_N_CHUNKS      16
+#define SLOW_CHUNK_DELAY_MS 20
+
+typedef struct {
+  GMutex   lock;
+  GCond    cond;
+  gboolean released;
+  guint    running;
+  guint    max_running;
+  guint    done;
+} Blocker;
+
+typedef struct {
+  gint64   last_tick;
+  gint64   max_gap;
+  guint    n_ticks;
+} Ticker;
+
+static gboolean
+on_tick (gpointer data)
+{
+  Ticker *ticker = data;
+  gint64 now = g_get_monotonic_time ();
+
+  if (ticker->last_tick)
+    ticker->max_gap = MAX (ticker->max_gap, now - ticker->last_tick);
+  ticker->last_tick = now;
+  ticker->n_ticks++;
+
+  return G_SOURCE_CONTINUE;
+}
+
+/* Stands in for a write to slow storage */
+static void
+blocking_thread (GTask        *task,
+                 gpointer      source_object,
+                 gpointer      task_data,
+                 GCancellable *cancellable)
+{
+  Blocker *blocker = task_data;
+
+  g_mutex_lock (&blocker->lock);
+  blocker->running++;
+  blocker->max_running = MAX (blocker->max_running, blocker->running);
+  g_cond_broadcast (&blocker->cond);
+  while (!blocker->released)
+    g_cond_wait (&blocker->cond, &blocker->lock);
+  blocker->running--;
+  g_mutex_unlock (&blocker->lock);
+
+  g_task_return_boolean (task, TRUE);
+}
+
+static void
+on_blocking_done (GObject *source_object, GAsyncResult *result, gpointer user_data)
+{
+  Blocker *blocker = user_data;
+
+  g_assert_true (g_task_propagate_boolean (G_TASK (result), NULL));
+  blocker->done++;
+}
+
+static void
+quick_thread (GTask        *task,
+              gpointer      source_object,
+              gpointer      task_data,
+              GCancellable *cancellable)
+{
+  g_task_return_boolean (task, TRUE);
+}
+
+static void
+on_quick_done (GObject *source_object, GAsyncResult *result, gpointer user_data)
+{
+  gboolean *done = user_data;
+
+  g_assert_true (g_task_propagate_boolean (G_TASK (result), NULL));
+  *done = TRUE;
+}
+
+static void
+test_io_pool_blocking (void)
+{
+  Blocker blocker = { 0 };
+  Ticker ticker = { 0 };
+  g_autoptr (GTask) quick = NULL;
+  gboolean quick_done = FALSE;
+  gint64 deadline;
+  guint tick_id;
+  int i;
+
+  g_mutex_init (&blocker.lock);
+  g_cond_init (&blocker.cond);
+
+  for (i = 0; i < N_BLOCKING_JOBS; i++) {
+    g_autoptr (GTask) task = g_task_new (NULL, NULL, on_blocking_done, &blocker);
+
+    g_task_set_task_data (task, &blocker, NULL);
+    pmp_io_pool_run (task, blocking_thread);
+  }
+
+  /* Wait until both of the pool's threads are busy */
+  g_mutex_lock (&blocker.lock);
+  while (blocker.running < 2)
+    g_cond_wait (&blocker.cond, &blocker.lock);
+  g_mutex_unlock (&blocker.lock);
+
+  /* Other work, like Settings requests, keeps going */
+  tick_id = g_timeout_add (TICK_INTERVAL_MS, on_tick, &ticker);
+  quick = g_task_new (NULL, NULL, on_quick_done, &quick_done);
+  g_task_run_in_thread (quick, quick_thread);
+
+  deadline = g_get_monotonic_time () + 20 * TICK_INTERVAL_MS * 1000;
+  while (!quick_done || g_get_monotonic_time () < deadline)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_true (quick_done);
+  g_assert_cmpuint (blocker.done, ==, 0);
+  g_assert_cmpuint (ticker.n_ticks, >, 1);
+  g_assert_cmpint (ticker.max_gap, <, MAX_TICK_GAP_MS * 1000);
+
+  g_mutex_lock (&blocker.lock);
+  /* The pool is bounded, the other jobs wait for a thread */
+  g_assert_cmpuint (blocker.max_running, <, N_BLOCKING_JOBS);
+  blocker.released = TRUE;
+  g_cond_broadcast (&blocker.cond);
+  g_mutex_unlock (&blocker.lock);
+
+  while (blocker.done < N_BLOCKING_JOBS)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_source_remove (tick_id);
+  g_mutex_clear (&blocker.lock);
+  g_cond_clear (&blocker.cond);
+}
+
+/* Feeds the fifo slowly like storage that can't keep up */
+static gpointer
+slow_writer (gpointer data)
+{
+  const char *path = data;
+  g_autofree guint8 *chunk = g_malloc (SLOW_CHUNK_SIZE);
+  FILE *fifo;
+  int i;
+
+  fifo = g_fopen (path, "wb");
+  g_assert_nonnull (fifo);
+
+  for (i = 0; i < SLOW_N_CHUNKS; i++) {
+    memset (chunk, i, SLOW_CHUNK_SIZE);
+    g_assert_cmpuint (fwrite (chunk, 1, SLOW_CHUNK_SIZE, fifo), ==, SLOW_CHUNK_SIZE);
+    fflush (fifo);
+    g_usleep (SLOW_CHUNK_DELAY_MS * 1000);
+  }
+
+  fclose (fifo);
+
+  return NULL;
+}
+
+static void
+on_copy_done (GObject *source_object, GAsyncResult *result, gpointer user_data)
+{
+  gboolean *done = user_data;
+  g_autoptr (GError) error = NULL;
+
+  g_assert_true (pmp_file_copy_finish (result, &error));
+  g_assert_no_error (error);
+  *done = TRUE;
+}
+
+static void
+test_io_pool_slow_copy (void)
+{
+  g_autoptr (GError) error = NULL;
+  g_autofree char *dir = g_dir_make_tmp ("pmp-test-io-pool-XXXXXX", &error);
+  g_autofree char *source_path = NULL;
+  g_autofree char *destination_path = NULL;
+  g_autofree char *contents = NULL;
+  g_autoptr (GFile) source = NULL;
+  g_autoptr (GFile) destination = NULL;
+  GThread *writer;
+  Ticker ticker = { 0 };
+  gboolean done = FALSE;
+  gsize len;
+  guint tick_id;
+  int i;
+
+  g_assert_no_error (error);
+  source_path = g_build_filename (dir, "source", NULL);
+  destination_path = g_build_filename (dir, "destination", NULL);
+  g_assert_cmpint (mkfifo (source_path, 0600), ==, 0);
+
+  source = g_file_new_for_path (source_path);
+  destination = g_file_new_for_path (destination_path);
+  writer = g_thread_new ("slow-writer", slow_writer, source_path);
+
+  tick_id = g_timeout_add (TICK_INTERVAL_MS, on_tick, &ticker);
+  pmp_file_copy_async (source, destination, G_PRIORITY_DEFAULT, NULL, on_copy_done, &done);
+  while (!done)
+    g_main_context_iteration (NULL, TRUE);
+  g_source_remove (tick_id);
+  g_thread_join (writer);
+
+  /* The copy took a while but the main loop kept dispatching */
+  g_assert_cmpuint (ticker.n_ticks, >, SLOW_N_CHUNKS);
+  g_assert_cmpint (ticker.max_gap, <, MAX_TICK_GAP_MS * 1000);
+
+  g_assert_true (g_file_get_contents (destination_path, &contents, &len, &error));
+  g_assert_no_error (error);
+  g_assert_cmpuint (len, ==, SLOW_CHUNK_SIZE * SLOW_N_CHUNKS);
+  for (i = 0; i < SLOW_N_CHUNKS; i++)
+    g_assert_cmpint (contents[i * SLOW_CHUNK_SIZE], ==, i);
+
+  g_unlink (destination_path);
+  g_unlink (source_path);
+  g_rmdir (dir);
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/pmp/io-pool/blocking", test_io_pool_blocking);
+  g_test_add_func ("/pmp/io-pool/slow-copy", test_io_pool_slow_copy);
+
+  return g_test_run ();
+}
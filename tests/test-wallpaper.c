@@ -0,0 +1,381 @@
+/*
+ * Copyright © 2024 The Phosh Developers
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "pmp-config.h"
+
+#include "pmp-utils.h"
+#include "pmp-wallpaper.h"
+
+#define G_SETTINGS_ENABLE_BACKEND
+#include <gio/gsettingsbackend.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include <glib/gstdio.h>
+
+#define TEST_WALLPAPER_IFACE "org.freedesktop.impl.portal.Wallpaper"
+#define SLOW_BACKEND_NAME    "pmp-test-slow"
+/* How long each settings write takes, like dconf on busy storage */
+#define SLOW_WRITE_MS        1000
+/* Interval of the main loop ticks and the largest gap we accept between them */
+#define TICK_INTERVAL_MS     10
+#define MAX_TICK_GAP_MS      250
+/* Give up if a request doesn't finish within that time */
+#define REQUEST_TIMEOUT_MS   (30 * 1000)
+
+/* Settings backend that stores values in memory but writes slowly */
+#define PMP_TYPE_SLOW_BACKEND (pmp_slow_backend_get_type ())
+G_DECLARE_FINAL_TYPE (PmpSlowBackend, pmp_slow_backend, PMP, SLOW_BACKEND, GSettingsBackend)
+
+struct _PmpSlowBackend {
+  GSettingsBackend parent;
+
+  GMutex           lock;
+  GHashTable      *values;
+  /* Writes started so far, atomic */
+  int              n_writes;
+};
+
+G_DEFINE_TYPE (PmpSlowBackend, pmp_slow_backend, G_TYPE_SETTINGS_BACKEND)
+
+typedef struct {
+  GTestDBus       *bus;
+  GDBusConnection *portal;
+  GDBusConnection *client;
+  char            *root;
+  char            *image;
+} Fixture;
+
+typedef struct {
+  gint64   last_tick;
+  gint64   max_gap;
+  guint    n_ticks;
+} Ticker;
+
+typedef struct {
+  gboolean done;
+  guint    response;
+  GError  *error;
+} Reply;
+
+static GVariant *
+pmp_slow_backend_read (GSettingsBackend   *backend,
+                       const char         *key,
+                       const GVariantType *expected_type,
+                       gboolean            default_value)
+{
+  PmpSlowBackend *self = PMP_SLOW_BACKEND (backend);
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&self->lock);
+  GVariant *value;
+
+  if (default_value)
+    return NULL;
+
+  value = g_hash_table_lookup (self->values, key);
+  if (!value || !g_variant_is_of_type (value, expected_type))
+    return NULL;
+
+  return g_variant_ref (value);
+}
+
+static gboolean
+store_value (gpointer key, gpointer value, gpointer data)
+{
+  PmpSlowBackend *self = data;
+
+  if (value)
+    g_hash_table_insert (self->values, g_strdup (key), g_variant_ref_sink (value));
+  else
+    g_hash_table_remove (self->values, key);
+
+  return FALSE;
+}
+
+static gboolean
+pmp_slow_backend_write_tree (GSettingsBackend *backend, GTree *tree, gpointer origin_tag)
+{
+  PmpSlowBackend *self = PMP_SLOW_BACKEND (backend);
+
+  /* Blocks whoever writes */
+  g_atomic_int_inc (&self->n_writes);
+  g_usleep (SLOW_WRITE_MS * 1000);
+
+  g_mutex_lock (&self->lock);
+  g_tree_foreach (tree, store_value, self);
+  g_mutex_unlock (&self->lock);
+
+  g_settings_backend_changed_tree (backend, tree, origin_tag);
+
+  return TRUE;
+}
+
+static gboolean
+pmp_slow_backend_write (GSettingsBackend *backend,
+                        const char       *key,
+                        GVariant         *value,
+                        gpointer          origin_tag)
+{
+  g_autoptr (GTree) tree = g_settings_backend_create_tree ();
+
+  g_tree_insert (tree, g_strdup (key), g_variant_ref_sink (value));
+
+  return pmp_slow_backend_write_tree (backend, tree, origin_tag);
+}
+
+static void
+pmp_slow_backend_reset (GSettingsBackend *backend, const char *key, gpointer origin_tag)
+{
+  PmpSlowBackend *self = PMP_SLOW_BACKEND (backend);
+
+  g_mutex_lock (&self->lock);
+  g_hash_table_remove (self->values, key);
+  g_mutex_unlock (&self->lock);
+
+  g_settings_backend_changed (backend, key, origin_tag);
+}
+
+static gboolean
+pmp_slow_backend_get_writable (GSettingsBackend *backend, const char *key)
+{
+  return TRUE;
+}
+
+static void
+pmp_slow_backend_finalize (GObject *object)
+{
+  PmpSlowBackend *self = PMP_SLOW_BACKEND (object);
+
+  g_hash_table_unref (self->values);
+  g_mutex_clear (&self->lock);
+
+  G_OBJECT_CLASS (pmp_slow_backend_parent_class)->finalize (object);
+}
+
+static void
+pmp_slow_backend_class_init (PmpSlowBackendClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  GSettingsBackendClass *backend_class = G_SETTINGS_BACKEND_CLASS (klass);
+
+  object_class->finalize = pmp_slow_backend_finalize;
+
+  backend_class->read = pmp_slow_backend_read;
+  backend_class->write = pmp_slow_backend_write;
+  backend_class->write_tree = pmp_slow_backend_write_tree;
+  backend_class->reset = pmp_slow_backend_reset;
+  backend_class->get_writable = pmp_slow_backend_get_writable;
+}
+
+static void
+pmp_slow_backend_init (PmpSlowBackend *self)
+{
+  g_mutex_init (&self->lock);
+  self->values = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                        (GDestroyNotify) g_variant_unref);
+}
+
+static gboolean
+on_tick (gpointer data)
+{
+  Ticker *ticker = data;
+  gint64 now = g_get_monotonic_time ();
+
+  if (ticker->last_tick)
+    ticker->max_gap = MAX (ticker->max_gap, now - ticker->last_tick);
+  ticker->last_tick = now;
+  ticker->n_ticks++;
+
+  return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+remove_tree (const char *path)
+{
+  g_autoptr (GDir) dir = g_dir_open (path, 0, NULL);
+  const char *name;
+
+  while (dir && (name = g_dir_read_name (dir))) {
+    g_autofree char *child = g_build_filename (path, name, NULL);
+
+    if (g_file_test (child, G_FILE_TEST_IS_DIR) && !g_file_test (child, G_FILE_TEST_IS_SYMLINK))
+      remove_tree (child);
+    else
+      g_unlink (child);
+  }
+
+  return g_rmdir (path) == 0;
+}
+
+static GDBusConnection *
+connect_bus (Fixture *fixture)
+{
+  g_autoptr (GError) error = NULL;
+  GDBusConnection *connection;
+
+  connection = g_dbus_connection_new_for_address_sync (g_test_dbus_get_bus_address (fixture->bus),
+                                                       G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+                                                       G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+                                                       NULL,
+                                                       NULL,
+                                                       &error);
+  g_assert_no_error (error);
+
+  return connection;
+}
+
+static void
+fixture_setup (Fixture *fixture, gconstpointer user_data)
+{
+  g_autoptr (GError) error = NULL;
+  g_autoptr (GdkPixbuf) pixbuf = NULL;
+  g_autofree char *data_dir = NULL;
+
+  fixture->root = g_dir_make_tmp ("pmp-test-wallpaper-XXXXXX", &error);
+  g_assert_no_error (error);
+
+  /* Keep the store away from the user's */
+  data_dir = g_build_filename (fixture->root, "data", NULL);
+  g_setenv ("XDG_DATA_HOME", data_dir, TRUE);
+
+  pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, FALSE, 8, 640, 480);
+  gdk_pixbuf_fill (pixbuf, 0x3465a4ff);
+  fixture->image = g_build_filename (fixture->root, "wallpaper.jpg", NULL);
+  g_assert_true (gdk_pixbuf_save (pixbuf, fixture->image, "jpeg", &error, NULL));
+  g_assert_no_error (error);
+
+  fixture->bus = g_test_dbus_new (G_TEST_DBUS_NONE);
+  g_test_dbus_up (fixture->bus);
+
+  /* Separate connections so requests come from another sender like in a session */
+  fixture->portal = connect_bus (fixture);
+  fixture->client = connect_bus (fixture);
+
+  g_assert_true (pmp_wallpaper_init (fixture->portal, &error));
+  g_assert_no_error (error);
+}
+
+static void
+fixture_teardown (Fixture *fixture, gconstpointer user_data)
+{
+  g_dbus_connection_close_sync (fixture->client, NULL, NULL);
+  g_clear_object (&fixture->client);
+  g_dbus_connection_close_sync (fixture->portal, NULL, NULL);
+  g_clear_object (&fixture->portal);
+  g_test_dbus_down (fixture->bus);
+  g_clear_object (&fixture->bus);
+
+  g_assert_true (remove_tree (fixture->root));
+  g_free (fixture->image);
+  g_free (fixture->root);
+}
+
+static void
+on_set_wallpaper_done (GObject *source_object, GAsyncResult *result, gpointer user_data)
+{
+  Reply *reply = user_data;
+  g_autoptr (GVariant) ret = NULL;
+
+  ret = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source_object), result, &reply->error);
+  if (ret)
+    g_variant_get (ret, "(u)", &reply->response);
+  reply->done = TRUE;
+}
+
+static void
+set_wallpaper (Fixture *fixture, const char *handle, const char *app_id, const char *uri, Reply *reply)
+{
+  GVariantBuilder options;
+
+  g_variant_builder_init (&options, G_VARIANT_TYPE_VARDICT);
+  g_variant_builder_add (&options, "{sv}", "show-preview", g_variant_new_boolean (FALSE));
+
+  g_dbus_connection_call (fixture->client,
+                          g_dbus_connection_get_unique_name (fixture->portal),
+                          DESKTOP_PORTAL_OBJECT_PATH,
+                          TEST_WALLPAPER_IFACE,
+                          "SetWallpaperURI",
+                          g_variant_new ("(ssssa{sv})", handle, app_id, "", uri, &options),
+                          G_VARIANT_TYPE ("(u)"),
+                          G_DBUS_CALL_FLAGS_NONE,
+                          REQUEST_TIMEOUT_MS,
+                          NULL,
+                          on_set_wallpaper_done,
+                          reply);
+}
+
+/*
+ * Applies a wallpaper while the settings take long to write. The
+ * main loop must keep dispatching and other requests must still be
+ * answered meanwhile.
+ */
+static void
+test_wallpaper_slow_settings (Fixture *fixture, gconstpointer user_data)
+{
+  g_autofree char *uri = g_filename_to_uri (fixture->image, NULL, NULL);
+  g_autofree char *picture_uri = NULL;
+  g_autoptr (GSettings) background = NULL;
+  g_autoptr (GSettingsBackend) backend = g_settings_backend_get_default ();
+  PmpSlowBackend *slow;
+  Ticker ticker = { 0 };
+  Reply apply = { 0 };
+  Reply other = { 0 };
+  guint tick_id;
+
+  g_assert_true (PMP_IS_SLOW_BACKEND (backend));
+  slow = PMP_SLOW_BACKEND (backend);
+
+  tick_id = g_timeout_add (TICK_INTERVAL_MS, on_tick, &ticker);
+
+  set_wallpaper (fixture, "/org/freedesktop/portal/desktop/request/test/1",
+                 "mobi.phosh.TestApply", uri, &apply);
+
+  /* Wait until the settings are being written */
+  while (!apply.done && !g_atomic_int_get (&slow->n_writes))
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_false (apply.done);
+
+  /* Another app's request still gets answered */
+  set_wallpaper (fixture, "/org/freedesktop/portal/desktop/request/test/2",
+                 "mobi.phosh.TestOther", "file:///nonexistent/wallpaper.jpg", &other);
+  while (!other.done)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_false (apply.done);
+  /* Rejected as invalid */
+  g_assert_nonnull (other.error);
+  g_assert_true (g_dbus_error_is_remote_error (other.error));
+  g_clear_error (&other.error);
+
+  while (!apply.done)
+    g_main_context_iteration (NULL, TRUE);
+  g_source_remove (tick_id);
+
+  g_assert_no_error (apply.error);
+  g_assert_cmpuint (apply.response, ==, 0);
+
+  /* The writes took a while but the main loop kept dispatching */
+  g_assert_cmpuint (ticker.n_ticks, >, SLOW_WRITE_MS / TICK_INTERVAL_MS / 2);
+  g_assert_cmpint (ticker.max_gap, <, MAX_TICK_GAP_MS * 1000);
+
+  background = g_settings_new ("org.gnome.desktop.background");
+  picture_uri = g_settings_get_string (background, "picture-uri");
+  g_assert_true (g_str_has_prefix (picture_uri, "file://"));
+  g_assert_cmpstr (picture_uri, !=, uri);
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_io_extension_point_implement (G_SETTINGS_BACKEND_EXTENSION_POINT_NAME,
+                                  PMP_TYPE_SLOW_BACKEND,
+                                  SLOW_BACKEND_NAME,
+                                  1000);
+  g_setenv ("GSETTINGS_BACKEND", SLOW_BACKEND_NAME, TRUE);
+
+  g_test_add ("/pmp/wallpaper/slow-settings", Fixture, NULL,
+              fixture_setup, test_wallpaper_slow_settings, fixture_teardown);
+
+  return g_test_run ();
+}